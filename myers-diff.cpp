@@ -1,27 +1,739 @@
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <regex>
+#include <bitset>
+#include <sstream>
+#include <string>
 #include <tuple>
+#include <type_traits>
 #include <cmath>
+#include <exception>
 #include <set>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <stop_token>
+#endif
 
-// Circular array
+#ifdef MYERS_WITH_ZLIB
+#include <zlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef MYERS_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+#include <arm_neon.h>
+#endif
+// The SVE kernels are built for SVE alone, through the target attribute, and only run where the CPU has it
+#if defined(__aarch64__) && defined(__linux__) && ((defined(__clang__) && __clang_major__ >= 17) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 12))
+#define MYERS_SVE_KERNELS
+#include <arm_sve.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SVE
+#define HWCAP_SVE (1 << 22)
+#endif
+#endif
+#ifdef MYERS_WITH_NUMA
+#include <numa.h>
+#include <numaif.h>
+#include <unistd.h>
+#endif
+
+/*
+Accounting for the library's own memory: every allocation made through CountingAllocator is counted here,
+under the stage of the diff it belongs to, so that the peak memory of a workload can be measured and limited.
+*/
+enum AllocationStage {
+    // Occurrence counts, compacted sequences and MatchRuns built before the search
+    kStagePrepass,
+    // The V arrays of FindMiddleSnake
+    kStageSearch,
+    // The nodes of the resulting Diff
+    kStageScript,
+    kStageCount
+};
+
+struct AllocationStats {
+    struct Counters {
+        std::atomic<long long> current_bytes{ 0 };
+        std::atomic<long long> peak_bytes{ 0 };
+        std::atomic<long long> allocations{ 0 };
+    };
+    // One set of counters per AllocationStage, and one for all of them together
+    Counters stages[kStageCount];
+    Counters total;
+
+    // Starts a new measurement: peaks restart from the memory in use now and the allocation counts from 0
+    void Reset() {
+        for (Counters* counters : { &stages[0], &stages[1], &stages[2], &total }) {
+            counters->peak_bytes = counters->current_bytes.load();
+            counters->allocations = 0;
+        }
+    }
+
+    void Write(std::ostream& out) const {
+        static const char* names[] = { "prepass", "search", "script" };
+        out << "peak " << total.peak_bytes << " bytes, " << total.allocations << " allocations";
+        for (int stage = 0; stage < kStageCount; stage++) {
+            out << "; " << names[stage] << ": peak " << stages[stage].peak_bytes << " bytes, " << stages[stage].allocations << " allocations";
+        }
+        out << "\n";
+    }
+};
+
+// What every thread's ThreadAllocationCounts have been merged into; read it through GlobalAllocationStats()
+AllocationStats& MergedAllocationStats() {
+    static AllocationStats stats;
+    return stats;
+}
+
+/*
+What one thread has allocated since it last merged its counts into GlobalAllocationStats(). Allocations are
+counted here in plain integers that no other thread touches, so pool workers that allocate Diff nodes at the
+same time do not contend on shared counters. The counts are merged when a job ends: when a ThreadPool task
+finishes, when the thread reads GlobalAllocationStats() and when the thread exits. A peak is merged as the
+memory in use at that moment plus the most this thread had added since its last merge, so the peaks of jobs
+that overlap in time are counted as if the jobs had run one after another.
+*/
+struct ThreadAllocationCounts {
+    struct Counters {
+        long long current_bytes = 0;
+        long long peak_bytes = 0;
+        long long allocations = 0;
+    };
+    Counters stages[kStageCount];
+    Counters total;
+
+    ~ThreadAllocationCounts() {
+        Merge();
+    }
+
+    void Merge() {
+        AllocationStats& stats = MergedAllocationStats();
+        AllocationStats::Counters* merged[] = { &stats.stages[0], &stats.stages[1], &stats.stages[2], &stats.total };
+        Counters* own[] = { &stages[0], &stages[1], &stages[2], &total };
+        for (int i = 0; i < kStageCount + 1; i++) {
+            long long peak = merged[i]->current_bytes.fetch_add(own[i]->current_bytes) + own[i]->peak_bytes;
+            long long previous = merged[i]->peak_bytes;
+            while (peak > previous && !merged[i]->peak_bytes.compare_exchange_weak(previous, peak)) {
+            }
+            merged[i]->allocations += own[i]->allocations;
+            *own[i] = Counters();
+        }
+    }
+};
+
+ThreadAllocationCounts& ThreadAllocations() {
+    thread_local ThreadAllocationCounts counts;
+    return counts;
+}
+
+// The allocations of every thread, as far as they have been merged, with this thread's own merged first
+AllocationStats& GlobalAllocationStats() {
+    ThreadAllocations().Merge();
+    return MergedAllocationStats();
+}
+
+// Thrown when an allocation would take a diff past its Options::memory_limit
+struct MemoryLimitExceeded : std::runtime_error {
+    MemoryLimitExceeded() : std::runtime_error("diff memory limit exceeded") {}
+};
+
+/*
+The memory limit of one diff and what it has allocated so far. A diff that runs tasks on other threads shares
+its budget with them (see MemoryBudgetScope), so the limit holds for the diff as a whole.
+*/
+struct MemoryBudget {
+    long long limit = 0;
+    std::atomic<long long> used{ 0 };
+};
+
+// The budget the allocations of this thread are charged to, if any
+MemoryBudget*& ThreadMemoryBudget() {
+    thread_local MemoryBudget* budget = nullptr;
+    return budget;
+}
+
+// Charges this thread's allocations to 'budget' (to none if it is null) until the scope ends
+class MemoryBudgetScope {
+public:
+    explicit MemoryBudgetScope(MemoryBudget* budget) : outer_(ThreadMemoryBudget()) {
+        ThreadMemoryBudget() = budget;
+    }
+    ~MemoryBudgetScope() {
+        ThreadMemoryBudget() = outer_;
+    }
+    MemoryBudgetScope(const MemoryBudgetScope&) = delete;
+    MemoryBudgetScope& operator=(const MemoryBudgetScope&) = delete;
+
+private:
+    MemoryBudget* outer_;
+};
+
+/*
+The budget a diff with Options::memory_limit 'limit' runs under: the one this thread is already charged to when
+that has a limit (the diff is part of a larger one, such as a gap of AnchoredDiff), else 'own' with 'limit', or
+no budget at all when there is no limit either.
+*/
+MemoryBudget* JoinMemoryBudget(MemoryBudget& own, long long limit) {
+    MemoryBudget* current = ThreadMemoryBudget();
+    if (current && current->limit > 0) {
+        return current;
+    }
+    if (limit > 0) {
+        own.limit = limit;
+        return &own;
+    }
+    return current;
+}
+
+// Adds 'bytes' (negative when freeing) to this thread's MemoryBudget, if any; more than its limit allows is refused
+void ChargeMemoryBudget(long long bytes) {
+    MemoryBudget* budget = ThreadMemoryBudget();
+    if (budget) {
+        long long used = budget->used += bytes;
+        if (budget->limit > 0 && bytes > 0 && used > budget->limit) {
+            budget->used -= bytes;
+            throw MemoryLimitExceeded();
+        }
+    }
+}
+
+// Holds 'bytes' of this thread's MemoryBudget until the scope ends
+class MemoryBudgetCharge {
+public:
+    explicit MemoryBudgetCharge(long long bytes) : budget_(ThreadMemoryBudget()), bytes_(bytes) {
+        ChargeMemoryBudget(bytes);
+    }
+    ~MemoryBudgetCharge() {
+        if (budget_) {
+            budget_->used -= bytes_;
+        }
+    }
+    MemoryBudgetCharge(const MemoryBudgetCharge&) = delete;
+    MemoryBudgetCharge& operator=(const MemoryBudgetCharge&) = delete;
+
+private:
+    MemoryBudget* budget_;
+    long long bytes_;
+};
+
+/*
+Adds 'bytes' (negative when freeing) to this thread's counters of 'stage' and to its totals. When 'charge' is
+set, they also go to this thread's MemoryBudget, and an allocation that would take it past its limit is
+refused with MemoryLimitExceeded before anything is counted.
+*/
+void CountAllocation(int stage, long long bytes, bool charge = true) {
+    if (charge) {
+        ChargeMemoryBudget(bytes);
+    }
+    ThreadAllocationCounts& counts = ThreadAllocations();
+    for (ThreadAllocationCounts::Counters* counters : { &counts.stages[stage], &counts.total }) {
+        counters->current_bytes += bytes;
+        if (bytes > 0) {
+            counters->allocations++;
+            counters->peak_bytes = std::max(counters->peak_bytes, counters->current_bytes);
+        }
+    }
+}
+
+/*
+A standard allocator that counts everything it allocates under 'Stage' (see ThreadAllocationCounts), and charges
+it to the thread's MemoryBudget unless it is the script: a diff's result grows with its edits, which no way of
+searching can make fewer, so Options::memory_limit leaves it out.
+*/
+template <typename T, int Stage>
+struct CountingAllocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef CountingAllocator<U, Stage> other;
+    };
+
+    CountingAllocator() {}
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U, Stage>&) {}
+
+    T* allocate(size_t n) {
+        CountAllocation(Stage, (long long)(n * sizeof(T)), Stage != kStageScript);
+        try {
+            return std::allocator<T>().allocate(n);
+        }
+        catch (...) {
+            CountAllocation(Stage, -(long long)(n * sizeof(T)), Stage != kStageScript);
+            throw;
+        }
+    }
+
+    void deallocate(T* p, size_t n) {
+        CountAllocation(Stage, -(long long)(n * sizeof(T)), Stage != kStageScript);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U, Stage>&) const { return true; }
+    template <typename U>
+    bool operator!=(const CountingAllocator<U, Stage>&) const { return false; }
+};
+
+// The vectors the pre-passes of DiffSequences work in
+template <typename T>
+using PrepassVector = std::vector<T, CountingAllocator<T, kStagePrepass>>;
+
+/*
+Circular array. Its memory is counted in the search stage but not charged to a MemoryBudget as it is allocated:
+it outlives the diff that grew it (see DiffWorkspace), so FindMiddleSnake charges it while it searches instead.
+*/
 class V {
 public:
-    V(int start, int end) : start_(start), end_(end), i_(new int[end - start + 1]) {}
+    V(int start, int end) : start_(start), end_(end), i_(Allocate(end - start + 1)) {}
 
     virtual ~V() {
-        delete[](i_);
+        Deallocate(i_, end_ - start_ + 1);
     }
     int& operator[](int index) {
         return i_[index - start_];
     }
+    // Makes the array cover start..end, reusing the current allocation when it is large enough
+    void Resize(int start, int end) {
+        if (end - start > end_ - start_) {
+            // Allocate first, so that the array is still intact if that fails
+            int* grown = Allocate(end - start + 1);
+            Deallocate(i_, end_ - start_ + 1);
+            i_ = grown;
+            end_ = end;
+        }
+        else {
+            end_ = start + (end_ - start_);
+        }
+        start_ = start;
+    }
+
+    // Gives back the memory beyond 'size' elements
+    void Shrink(int size) {
+        if (end_ - start_ + 1 > size) {
+            int* shrunk = Allocate(size);
+            Deallocate(i_, end_ - start_ + 1);
+            i_ = shrunk;
+            end_ = start_ + size - 1;
+        }
+    }
+
+    long long Bytes() const {
+        return (long long)(end_ - start_ + 1) * sizeof(int);
+    }
 private:
-    int* i_;
+    static int* Allocate(int size) {
+        CountAllocation(kStageSearch, (long long)size * sizeof(int), false);
+        return std::allocator<int>().allocate(size);
+    }
+    static void Deallocate(int* p, int size) {
+        CountAllocation(kStageSearch, -(long long)size * sizeof(int), false);
+        std::allocator<int>().deallocate(p, size);
+    }
+
     int start_;
     int end_;
+    int* i_;
+};
+
+/*
+The scratch memory of one thread's diffs, which for now is the pair of V arrays FindMiddleSnake searches
+with. Every thread gets its own on first use and it only ever grows, so a thread that runs many diffs (such as
+a ThreadPool worker) allocates once for the largest of them, and threads never share one.
+*/
+struct DiffWorkspace {
+    DiffWorkspace() : Vf(0, 0), Vb(0, 0) {}
+
+    // Makes both arrays cover the diagonals -MAX..MAX
+    void Reserve(int MAX) {
+        Vf.Resize(-MAX, MAX);
+        Vb.Resize(-MAX, MAX);
+    }
+
+    // What both arrays take up after Reserve(MAX)
+    long long Bytes(int MAX) const {
+        return 2 * std::max(Vf.Bytes(), (2LL * MAX + 1) * (long long)sizeof(int));
+    }
+
+    // Gives back what was kept from earlier diffs beyond the diagonals -MAX..MAX
+    void Trim(int MAX) {
+        Vf.Shrink(2 * MAX + 1);
+        Vb.Shrink(2 * MAX + 1);
+    }
+
+    // The array that holds the 'best possible x values' in search from top left to bottom right
+    V Vf;
+    // The array that holds the 'best possible x values' in search from bottom right to top left
+    V Vb;
+
+    // While set, ShortestEditScript throws DiffCancelled once this becomes true
+    const std::atomic<bool>* cancel = nullptr;
+};
+
+DiffWorkspace& ThreadWorkspace() {
+    thread_local DiffWorkspace workspace;
+    return workspace;
+}
+
+// Thrown out of a diff that was cancelled through DiffWorkspace::cancel
+struct DiffCancelled : std::runtime_error {
+    DiffCancelled() : std::runtime_error("diff cancelled") {}
 };
 
 // Difference Result
-typedef std::multiset<std::pair<int, std::string>> Diff;
+typedef std::multiset<std::pair<int, std::string>, std::less<std::pair<int, std::string>>,
+                      CountingAllocator<std::pair<int, std::string>, kStageScript>> Diff;
+
+// Whether 'a == b' compiles for two T
+template <typename T, typename Enable = void>
+struct HasEqualityOperator : std::false_type {};
+
+template <typename T>
+struct HasEqualityOperator<T, decltype(void(std::declval<const T&>() == std::declval<const T&>()))> : std::true_type {};
+
+/*
+How the diff compares and hashes elements. By default it uses '==' and std::hash, which covers int, the
+interned line ids, and 64-bit keys such as record ids. Trivially copyable structs (fixed-size records, index
+entries) with no operator== and no padding, so that equal values are equal bytes, are compared bytewise with
+memcmp and hashed a word at a time; they can be diffed as they are instead of being interned to ints first.
+A struct that defines operator== is compared with it. Specialize this for element types that need anything
+else, e.g. a hash for a struct with operator==, or bytewise comparison for a struct with padding.
+*/
+template <typename T, typename Enable = void>
+struct ElementTraits {
+    static bool Equal(const T& a, const T& b) {
+        return a == b;
+    }
+    static size_t Hash(const T& a) {
+        return std::hash<T>()(a);
+    }
+};
+
+template <typename T>
+struct ElementTraits<T, typename std::enable_if<std::is_trivially_copyable<T>::value && std::is_class<T>::value &&
+                                                std::has_unique_object_representations<T>::value && !HasEqualityOperator<T>::value>::type> {
+    static bool Equal(const T& a, const T& b) {
+        return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+    static size_t Hash(const T& a) {
+        // FNV-1a over 64-bit words, then over the remaining bytes
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&a);
+        uint64_t hash = 14695981039346656037ull;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= sizeof(T); i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+        for (; i < sizeof(T); i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return size_t(hash ^ (hash >> 32));
+    }
+};
+
+// Hash and equality functors over ElementTraits, for hash tables keyed by elements
+template <typename T>
+struct ElementHash {
+    size_t operator()(const T& a) const {
+        return ElementTraits<T>::Hash(a);
+    }
+};
+
+template <typename T>
+struct ElementEqual {
+    bool operator()(const T& a, const T& b) const {
+        return ElementTraits<T>::Equal(a, b);
+    }
+};
+
+/*
+Snake extension kernels: how many elements two int sequences have in common from the front (forward) or
+from the back (backward, where 'a' and 'b' point one past the last element). FindMiddleSnake spends most of
+its time in these loops on inputs with long snakes, and DiffSequences uses them to trim the common prefix
+and suffix before searching. There is a scalar kernel everywhere, SSE2 and AVX2 kernels on x86 (AVX2 when the
+CPU has it), and NEON and SVE kernels on aarch64 (SVE when the kernel reports it in AT_HWCAP). ActiveSnakeKernel
+picks the best one on first use; SelectSnakeKernel overrides that, e.g. to benchmark the scalar kernel.
+*/
+struct SnakeKernel {
+    const char* name;
+    int (*forward)(const int* a, const int* b, int n);
+    int (*backward)(const int* a, const int* b, int n);
+};
+
+int ScalarMatchForward(const int* a, const int* b, int n) {
+    int i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+int ScalarMatchBackward(const int* a, const int* b, int n) {
+    int i = 0;
+    while (i < n && a[-i - 1] == b[-i - 1]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+int Sse2MatchForward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        unsigned mask = unsigned(_mm_movemask_epi8(eq));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask) / 4;
+        }
+    }
+    return i + ScalarMatchForward(a + i, b + i, n - i);
+}
+
+int Sse2MatchBackward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a - i - 4)), _mm_loadu_si128((const __m128i*)(b - i - 4)));
+        unsigned mask = unsigned(_mm_movemask_epi8(eq));
+        if (mask != 0xFFFF) {
+            // The highest lane that differs ends the match
+            return i + __builtin_clz(~mask << 16) / 4;
+        }
+    }
+    return i + ScalarMatchBackward(a - i, b - i, n - i);
+}
+
+__attribute__((target("avx2"))) int Avx2MatchForward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        unsigned mask = unsigned(_mm256_movemask_epi8(eq));
+        if (mask != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~mask) / 4;
+        }
+    }
+    return i + Sse2MatchForward(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) int Avx2MatchBackward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a - i - 8)), _mm256_loadu_si256((const __m256i*)(b - i - 8)));
+        unsigned mask = unsigned(_mm256_movemask_epi8(eq));
+        if (mask != 0xFFFFFFFFu) {
+            return i + __builtin_clz(~mask) / 4;
+        }
+    }
+    return i + Sse2MatchBackward(a - i, b - i, n - i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+int NeonMatchForward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t eq = vceqq_s32(vld1q_s32(a + i), vld1q_s32(b + i));
+        if (vminvq_u32(eq) != 0xFFFFFFFFu) {
+            // One 16-bit lane per element, all ones where equal
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+            return i + __builtin_ctzll(~bits) / 16;
+        }
+    }
+    return i + ScalarMatchForward(a + i, b + i, n - i);
+}
+
+int NeonMatchBackward(const int* a, const int* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t eq = vceqq_s32(vld1q_s32(a - i - 4), vld1q_s32(b - i - 4));
+        if (vminvq_u32(eq) != 0xFFFFFFFFu) {
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+            return i + __builtin_clzll(~bits) / 16;
+        }
+    }
+    return i + ScalarMatchBackward(a - i, b - i, n - i);
+}
+#endif
+
+#ifdef MYERS_SVE_KERNELS
+__attribute__((target("+sve"))) int SveMatchForward(const int* a, const int* b, int n) {
+    for (int i = 0; i < n; i += int(svcntw())) {
+        svbool_t active = svwhilelt_b32(i, n);
+        svbool_t differ = svcmpne_s32(active, svld1_s32(active, a + i), svld1_s32(active, b + i));
+        if (svptest_any(active, differ)) {
+            // The lanes before the first difference
+            return i + int(svcntp_b32(active, svbrkb_b_z(active, differ)));
+        }
+    }
+    return n;
+}
+
+__attribute__((target("+sve"))) int SveMatchBackward(const int* a, const int* b, int n) {
+    for (int i = 0; i < n; i += int(svcntw())) {
+        int count = std::min(n - i, int(svcntw()));
+        svbool_t active = svwhilelt_b32(0, count);
+        svbool_t differ = svcmpne_s32(active, svld1_s32(active, a - i - count), svld1_s32(active, b - i - count));
+        if (svptest_any(active, differ)) {
+            // The lanes above the last difference
+            int last = int(svlastb_u32(differ, svindex_u32(0, 1)));
+            return i + count - 1 - last;
+        }
+    }
+    return n;
+}
+#endif
+
+const SnakeKernel& ScalarSnakeKernel() {
+    static const SnakeKernel kernel = { "scalar", ScalarMatchForward, ScalarMatchBackward };
+    return kernel;
+}
+
+// The fastest kernel this build and CPU support
+const SnakeKernel& BestSnakeKernel() {
+#if defined(__SSE2__) && defined(__GNUC__)
+    static const SnakeKernel sse2 = { "sse2", Sse2MatchForward, Sse2MatchBackward };
+    static const SnakeKernel avx2 = { "avx2", Avx2MatchForward, Avx2MatchBackward };
+    return __builtin_cpu_supports("avx2") ? avx2 : sse2;
+#elif defined(__aarch64__) && defined(__GNUC__)
+    static const SnakeKernel neon = { "neon", NeonMatchForward, NeonMatchBackward };
+#ifdef MYERS_SVE_KERNELS
+    static const SnakeKernel sve = { "sve", SveMatchForward, SveMatchBackward };
+    if (getauxval(AT_HWCAP) & HWCAP_SVE) {
+        return sve;
+    }
+#endif
+    return neon;
+#else
+    return ScalarSnakeKernel();
+#endif
+}
+
+std::atomic<const SnakeKernel*>& SnakeKernelSlot() {
+    static std::atomic<const SnakeKernel*> slot(&BestSnakeKernel());
+    return slot;
+}
+
+const SnakeKernel& ActiveSnakeKernel() {
+    return *SnakeKernelSlot().load(std::memory_order_relaxed);
+}
+
+// Makes 'kernel' the one every later diff uses
+void SelectSnakeKernel(const SnakeKernel& kernel) {
+    SnakeKernelSlot().store(&kernel, std::memory_order_relaxed);
+}
+
+/*
+How many leading (CommonPrefix) or trailing (CommonSuffix) elements of the first 'n' of two sequences are
+equal. ints go through ActiveSnakeKernel; other element types compare one at a time.
+*/
+template <typename T>
+int CommonPrefix(const T a[], const T b[], int n) {
+    int i = 0;
+    while (i < n && ElementTraits<T>::Equal(a[i], b[i])) {
+        i++;
+    }
+    return i;
+}
+
+int CommonPrefix(const int a[], const int b[], int n) {
+    return ActiveSnakeKernel().forward(a, b, n);
+}
+
+// Here 'a' and 'b' point one past the last element
+template <typename T>
+int CommonSuffix(const T a[], const T b[], int n) {
+    int i = 0;
+    while (i < n && ElementTraits<T>::Equal(a[-i - 1], b[-i - 1])) {
+        i++;
+    }
+    return i;
+}
+
+int CommonSuffix(const int a[], const int b[], int n) {
+    return ActiveSnakeKernel().backward(a, b, n);
+}
+
+/*
+The lengths of the runs of equal elements in both sequences: 'old_forward[i]' is how many elements starting at
+old_sequence[i] are equal to it, and 'old_backward[i]' how many ending at old_sequence[i]. When both sequences
+are dominated by long runs (padding, repeated records), FindMiddleSnake reaches the same runs from many
+diagonals, and these let it cross a whole run in one step instead of one element at a time.
+*/
+struct MatchRuns {
+    PrepassVector<int> old_forward, old_backward, new_forward, new_backward;
+};
+
+// Fills in the run lengths of 'sequence' in both directions
+template <typename T>
+void CountRuns(const T sequence[], int N, PrepassVector<int>& forward, PrepassVector<int>& backward) {
+    forward.resize(N);
+    backward.resize(N);
+    for (int i = 0; i < N; i++) {
+        backward[i] = i > 0 && ElementTraits<T>::Equal(sequence[i], sequence[i - 1]) ? backward[i - 1] + 1 : 1;
+    }
+    for (int i = N - 1; i >= 0; i--) {
+        forward[i] = i < N - 1 && ElementTraits<T>::Equal(sequence[i], sequence[i + 1]) ? forward[i + 1] + 1 : 1;
+    }
+}
+
+/*
+Guesses whether building MatchRuns pays off by looking at up to 'samples' evenly spaced positions of each
+sequence. Runs pay off once the average run is a few elements long, i.e. once most elements are equal to
+their successor.
+*/
+template <typename T>
+bool HasLongRuns(const T old_sequence[], int N, const T new_sequence[], int M, int samples = 1024) {
+    int repeated = 0, probed = 0;
+    const T* sequences[] = { old_sequence, new_sequence };
+    int lengths[] = { N, M };
+    for (int s = 0; s < 2; s++) {
+        int stride = std::max(1, (lengths[s] - 1) / samples);
+        for (int i = 0; i + 1 < lengths[s]; i += stride) {
+            repeated += ElementTraits<T>::Equal(sequences[s][i], sequences[s][i + 1]);
+            probed++;
+        }
+    }
+    return probed > 0 && 4 * repeated >= 3 * probed;
+}
 
 /*
 This function is a concrete implementation of the algorithm for 'finding the middle snake' presented
@@ -46,7 +758,8 @@ of this implementation have opposite sign compared with those suggested in the p
 the algorithm easier to implement as it makes the forwardand reverse directions more symmetric.
 
 @old_sequence  This represents a sequence of something that can be compared against 'new_sequence'
-using the '==' operator.  It could be characters, or lines of text or something different.
+through ElementTraits (the '==' operator unless specialized).  It could be characters, or lines of text,
+64-bit keys or fixed-size records.
 
 @N  The length of 'old_sequence'
 
@@ -64,18 +777,26 @@ middle snake.
 
 The next two return values are the point(u, v) representing the end coordinate of the middle snake.
 It is possible that(x, y) == (u, v)
+
+@runs  Optional run lengths for the whole sequences, which old_sequence and new_sequence start 'offset_x' and
+'offset_y' elements into. Snakes are then extended a run at a time.
 */
-std::tuple<int, int, int, int, int> FindMiddleSnake(const int old_sequence[], int N, const int new_sequence[], int M) {
+template <typename T>
+std::tuple<int, int, int, int, int> FindMiddleSnake(const T old_sequence[], int N, const T new_sequence[], int M,
+                                                    const MatchRuns* runs = nullptr, int offset_x = 0, int offset_y = 0) {
     // The difference between the length of the sequences
     int Delta = N - M;
 
     // The sum of the length of the sequences
     int MAX = M + N;
 
-    // The array that holds the 'best possible x values' in search from top left to bottom right
-    static V Vf(-MAX, MAX);
-    // The array that holds the 'best possible x values' in search from bottom right to top left
-    static V Vb(-MAX, MAX);
+    // The arrays that hold the 'best possible x values' in both directions, reused from earlier calls on this
+    // thread; all of their memory counts against the diff's budget while it searches, whichever diff grew them
+    DiffWorkspace& workspace = ThreadWorkspace();
+    MemoryBudgetCharge charge(workspace.Bytes(MAX));
+    workspace.Reserve(MAX);
+    V& Vf = workspace.Vf;
+    V& Vb = workspace.Vb;
 
     // The initial point at (0, -1)
     Vf[1] = 0;
@@ -86,9 +807,12 @@ std::tuple<int, int, int, int, int> FindMiddleSnake(const int old_sequence[], in
     int x_i, y_i;
 
     // We only need to iterate to ceil('max edit length'/2) because we're searching in both directions
-    for (int D = 0; D <= std::ceil(MAX / 2.0); D++) {
+    const int D_MAX = (MAX + 1) / 2;
+    // Paths from both directions can only meet on the forward pass when Delta is odd
+    const bool odd = Delta % 2 != 0;
+    for (int D = 0; D <= D_MAX; D++) {
         for (int k = -D; k <= D; k += 2) {
-            if (k == -D || k != D && Vf[k - 1] < Vf[k + 1]) {
+            if (k == -D || (k != D && Vf[k - 1] < Vf[k + 1])) {
                 // Did not increase x, but we'll take the better (or only) x value from the k line above
                 x = Vf[k + 1];
             }
@@ -102,22 +826,31 @@ std::tuple<int, int, int, int, int> FindMiddleSnake(const int old_sequence[], in
             x_i = x;
             y_i = y;
             // While these sequences are identical, keep moving through the graph with no cost
-            while (x < N && y < M && old_sequence[x] == new_sequence[y]) {
-                x += 1;
-                y += 1;
+            while (x < N && y < M && ElementTraits<T>::Equal(old_sequence[x], new_sequence[y])) {
+                if (runs) {
+                    // Both runs hold the same element, so the snake covers at least the shorter of them
+                    int step = std::min(std::min(runs->old_forward[offset_x + x], runs->new_forward[offset_y + y]), std::min(N - x, M - y));
+                    x += step;
+                    y += step;
+                    continue;
+                }
+                // The first pair matched, the kernel finds where the snake ends
+                int step = 1 + CommonPrefix(old_sequence + x + 1, new_sequence + y + 1, std::min(N - x, M - y) - 1);
+                x += step;
+                y += step;
             }
             // This is the new best x value
             Vf[k] = x;
             // Only check for connections from the forward search when N - M is odd
             // and when there is a reciprocal k line coming from the other direction.
-            if ((_abs64(Delta % 2) == 1) && (-(k - Delta)) >= -(D - 1) && (-(k - Delta)) <= (D - 1)) {
+            if (odd && (-(k - Delta)) >= -(D - 1) && (-(k - Delta)) <= (D - 1)) {
                 if (Vf[k] + Vb[-(k - Delta)] >= N) {
                     return std::make_tuple(2 * D - 1, x_i, y_i, x, y);
                 }
             }
         }
         for (int k = -D; k <= D; k += 2) {
-            if (k == -D || k != D && Vb[k - 1] < Vb[k + 1]) {
+            if (k == -D || (k != D && Vb[k - 1] < Vb[k + 1])) {
                 x = Vb[k + 1];
             }
             else {
@@ -126,12 +859,19 @@ std::tuple<int, int, int, int, int> FindMiddleSnake(const int old_sequence[], in
             y = x - k;
             x_i = x;
             y_i = y;
-            while (x < N && y < M && old_sequence[N - x - 1] == new_sequence[M - y - 1]) {
-                x += 1;
-                y += 1;
+            while (x < N && y < M && ElementTraits<T>::Equal(old_sequence[N - x - 1], new_sequence[M - y - 1])) {
+                if (runs) {
+                    int step = std::min(std::min(runs->old_backward[offset_x + N - x - 1], runs->new_backward[offset_y + M - y - 1]), std::min(N - x, M - y));
+                    x += step;
+                    y += step;
+                    continue;
+                }
+                int step = 1 + CommonSuffix(old_sequence + N - x - 1, new_sequence + M - y - 1, std::min(N - x, M - y) - 1);
+                x += step;
+                y += step;
             }
             Vb[k] = x;
-            if (Delta % 2 == 0 && (-(k-Delta)) >= -D && (-(k-Delta)) <= D) {
+            if (!odd && (-(k-Delta)) >= -D && (-(k-Delta)) <= D) {
                 if (Vb[k] + Vf[(-(k-Delta))] >= N) {
                     return std::make_tuple(2 * D, N - x, M - y, N - x_i, M - y_i);
                 }
@@ -146,7 +886,8 @@ This function is a concrete implementation of the algorithm for finding the shor
 'left as an exercise' on page 12 of 'An O(ND) Difference Algorithm and Its Variations' by EUGENE W.MYERS.
 
 @old_sequence  This represents a sequence of something that can be compared against 'new_sequence'
-using the '==' operator.  It could be characters, or lines of text or something different.
+through ElementTraits (the '==' operator unless specialized).  It could be characters, or lines of text,
+64-bit keys or fixed-size records.
 
 @N  The length of 'old_sequence'
 
@@ -154,57 +895,64 @@ using the '==' operator.  It could be characters, or lines of text or something
 
 @M  The length of 'new_sequence'
 
+@runs  Optional run lengths for the whole sequences, see FindMiddleSnake
+
 The return value is a sequence of objects that contains the indicies in old_sequnce and new_sequnce that
 you could use to produce new_sequence from old_sequence using the minimum number of edits.
 
 The format of this function as it is currently written is optimized for clarity, not efficiency.It is
 expected that anyone wanting to use this function in a real application would modify the 2 lines noted
-below to produce whatever representation of the edit sequence you wanted.
+below to produce whatever representation of the edit sequence you wanted, or write it out afterwards with
+one of the formatters below.
 */
-Diff ShortestEditScript(const int old_sequence[], int N, const int new_sequence[], int M, int current_x, int current_y) {
+template <typename T>
+Diff ShortestEditScript(const T old_sequence[], int N, const T new_sequence[], int M, int current_x, int current_y,
+                        const MatchRuns* runs = nullptr) {
     Diff rtn;
-    
+
+    const std::atomic<bool>* cancel = ThreadWorkspace().cancel;
+    if (cancel && *cancel) {
+        throw DiffCancelled();
+    }
     if (N > 0 && M > 0) {
         int D, x, y, u, v;
-        std::tie(D, x, y, u, v) = FindMiddleSnake(old_sequence, N, new_sequence, M);
+        std::tie(D, x, y, u, v) = FindMiddleSnake(old_sequence, N, new_sequence, M, runs, current_x, current_y);
         // If the graph represented by the current sequences can be further subdivided
         if (D > 1 || (x != u && y != v)) {
             // Collection delete/inserts before the snake
             Diff _rtn;
             _rtn.clear();
-            _rtn = ShortestEditScript(old_sequence, x, new_sequence, y, current_x, current_y);
+            _rtn = ShortestEditScript(old_sequence, x, new_sequence, y, current_x, current_y, runs);
             rtn.insert(_rtn.begin(), _rtn.end());
             // Collection delete/inserts after the snake
             _rtn.clear();
-            _rtn = ShortestEditScript(old_sequence + u, N - u, new_sequence + v, M - v, current_x + u, current_y + v);
+            _rtn = ShortestEditScript(old_sequence + u, N - u, new_sequence + v, M - v, current_x + u, current_y + v, runs);
             rtn.insert(_rtn.begin(), _rtn.end());
         }
         else if (M > N) {
             // M is longer than N, but we know there is a maximum of one edit to transform old_sequence into new_sequence
             // The first N elements of both sequences in this case will represent the snake, and the last element
             // will represent a single insertion
-            Diff _rtn = ShortestEditScript(old_sequence + N, N - N, new_sequence + N, M - N, current_x + N, current_y + N);
+            Diff _rtn = ShortestEditScript(old_sequence + N, N - N, new_sequence + N, M - N, current_x + N, current_y + N, runs);
             rtn.insert(_rtn.begin(), _rtn.end());
         }
         else if (M < N) {
             // N is longer than (or equal to) M, but we know there is a maximum of one edit to transform old_sequence to new_sequence
             // The first M elements of both sequences in this case will represent the snake, and the last element
             // will represent a single deletion. If M == N, then this reduces to a snake which does not contain any edits
-            Diff _rtn = ShortestEditScript(old_sequence + M, N - M, new_sequence + M, M - M, current_x + M, current_y + M);
+            Diff _rtn = ShortestEditScript(old_sequence + M, N - M, new_sequence + M, M - M, current_x + M, current_y + M, runs);
             rtn.insert(_rtn.begin(), _rtn.end());
         }
     }
     else if (N > 0) {
         // This area of the graph consist of only horizontal edges that represent deletions
         for (int i = 0; i < N; i++) {
-            std::cout << "{del, pos_old: " << current_x + i << "val: " << old_sequence[i] << "}\n";
             rtn.insert(std::make_pair(current_x + i, "del"));
         }
     }
     else if (M > 0) {
         // This area of the graph consist of only vertical edges that represent insertions
         for (int i = 0; i < M; i++) {
-            std::cout << "{add, pos_old: " << current_x << " pos_new: " << current_y+i << " val: " << new_sequence[i] << "}\n";
             rtn.insert(std::make_pair(current_y + i, "add"));
         }
     }
@@ -212,12 +960,4746 @@ Diff ShortestEditScript(const int old_sequence[], int N, const int new_sequence[
     return rtn;
 }
 
-int main() {
+// A diagonal run of matching elements: old_sequence[x + i] == new_sequence[y + i] for 0 <= i < length
+struct Snake {
+    int x;
+    int y;
+    int length;
+};
+
+/*
+Finds a longest common subsequence, the dual of ShortestEditScript, and appends it to 'snakes' as the
+diagonal runs it is made of, in order. It follows the same recursion, but where ShortestEditScript keeps the
+edits on either side of each middle snake this keeps the middle snakes themselves, which are exactly the
+matched runs. The alignment therefore comes straight out of the search, without reconstructing it from the
+edits. Runs that touch are merged, so consecutive entries never continue each other.
+
+@current_x, @current_y  Where old_sequence and new_sequence start in the sequences the snakes refer to
+
+@runs  Optional run lengths for the whole sequences, see FindMiddleSnake
+*/
+template <typename T>
+void CommonSnakes(const T old_sequence[], int N, const T new_sequence[], int M, int current_x, int current_y,
+                  std::vector<Snake>& snakes, const MatchRuns* runs = nullptr) {
+    auto append = [&snakes](int x, int y, int length) {
+        if (length <= 0) {
+            return;
+        }
+        if (!snakes.empty() && snakes.back().x + snakes.back().length == x && snakes.back().y + snakes.back().length == y) {
+            snakes.back().length += length;
+        }
+        else {
+            snakes.push_back(Snake{ x, y, length });
+        }
+    };
+
+    if (N > 0 && M > 0) {
+        int D, x, y, u, v;
+        std::tie(D, x, y, u, v) = FindMiddleSnake(old_sequence, N, new_sequence, M, runs, current_x, current_y);
+        if (D > 1 || (x != u && y != v)) {
+            CommonSnakes(old_sequence, x, new_sequence, y, current_x, current_y, snakes, runs);
+            append(current_x + x, current_y + y, u - x);
+            CommonSnakes(old_sequence + u, N - u, new_sequence + v, M - v, current_x + u, current_y + v, snakes, runs);
+        }
+        else {
+            // At most one edit, which comes after the shorter sequence has been matched in full
+            append(current_x, current_y, std::min(N, M));
+        }
+    }
+}
+
+// Settings for DiffSequences
+struct Options {
+    // Extend snakes a whole run of equal elements at a time (see MatchRuns): 1 always, 0 never,
+    // -1 only when HasLongRuns finds the inputs dominated by runs
+    int match_runs = -1;
+    // Drop elements that never occur in the other sequence before searching (they can only be edits),
+    // which keeps the result minimal while shrinking N and M
+    bool discard_unique = true;
+    // Also drop runs of very frequent elements (blank lines, lone braces) that sit among unmatched ones, as
+    // GNU diff's discard_confusing_lines does. They are reported as edits, so the result is no longer
+    // guaranteed minimal, but D and the work per D stay small on inputs dominated by a few elements.
+    bool discard_confusing = false;
+    // When both sequences are numbers in strictly increasing order (sorted keys, id sets), compute the script
+    // with SortedMerge instead of searching. The result is the same as the search's.
+    bool merge_sorted = true;
+    // If not 0, the most memory in bytes the diff may work in: the pre-pass tables, the search arrays (all of
+    // this thread's, including what it kept from earlier diffs) and, for AnchoredDiff and BlockMatchDiff, their
+    // anchor and block indexes. The resulting script is not counted, as it grows with the edits whatever the
+    // search does (about 100 bytes each). When the estimate for the inputs is larger than the limit, the inputs
+    // are diffed in chunks that fit (the result is then no longer minimal); if the limit is still hit,
+    // DiffSequences throws MemoryLimitExceeded. AnchoredDiff and BlockMatchDiff hold all of their tasks to one
+    // limit together. ParallelEditScript and UnorderedDiff take no Options and are not limited.
+    long long memory_limit = 0;
+};
+
+/*
+Estimates the memory DiffSequences needs for the search itself, not counting the resulting script: the two V
+arrays of 2 * (N + M) + 1 ints each, and the pre-pass tables.
+*/
+long long EstimateDiffMemory(int N, int M, const Options& options) {
+    long long elements = (long long)N + M;
+    long long bytes = 2 * (2 * elements + 1) * (long long)sizeof(int);
+    if (options.discard_unique || options.discard_confusing) {
+        // Counts, kept elements and their indexes, keep flags and discard flags
+        bytes += elements * (3 * sizeof(int) + 2 * sizeof(char)) + 4 * elements * (long long)sizeof(int);
+    }
+    if (options.match_runs != 0) {
+        bytes += 2 * elements * (long long)sizeof(int);
+    }
+    return bytes;
+}
+
+/*
+Counts, for every element of 'sequence', how often it occurs in 'other'. Interned line ids are small and
+dense, so the common case is a flat table indexed by value, filled and probed in straight loops; sparse
+values fall back to a hash map.
+*/
+PrepassVector<int> CountIn(const int sequence[], int N, const int other[], int M) {
+    PrepassVector<int> counts(N);
+    if (M == 0) {
+        return counts;
+    }
+    int low = *std::min_element(other, other + M);
+    int high = *std::max_element(other, other + M);
+    if (int64_t(high) - low <= 4 * int64_t(N + M) + 1024) {
+        PrepassVector<int> table(size_t(int64_t(high) - low + 1));
+        for (int j = 0; j < M; j++) {
+            table[other[j] - low]++;
+        }
+        for (int i = 0; i < N; i++) {
+            counts[i] = sequence[i] >= low && sequence[i] <= high ? table[sequence[i] - low] : 0;
+        }
+    }
+    else {
+        typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, CountingAllocator<std::pair<const int, int>, kStagePrepass>> Table;
+        Table table;
+        for (int j = 0; j < M; j++) {
+            table[other[j]]++;
+        }
+        for (int i = 0; i < N; i++) {
+            Table::const_iterator it = table.find(sequence[i]);
+            counts[i] = it != table.end() ? it->second : 0;
+        }
+    }
+    return counts;
+}
+
+// CountIn for any other element type, through a hash table over ElementTraits
+template <typename T>
+PrepassVector<int> CountIn(const T sequence[], int N, const T other[], int M) {
+    PrepassVector<int> counts(N);
+    typedef std::unordered_map<T, int, ElementHash<T>, ElementEqual<T>, CountingAllocator<std::pair<const T, int>, kStagePrepass>> Table;
+    Table table;
+    for (int j = 0; j < M; j++) {
+        table[other[j]]++;
+    }
+    for (int i = 0; i < N; i++) {
+        typename Table::const_iterator it = table.find(sequence[i]);
+        counts[i] = it != table.end() ? it->second : 0;
+    }
+    return counts;
+}
+
+/*
+Flags, for every element of 'sequence', whether it occurs in 'other' at all. This is what ChooseKept decides
+when only unique elements are discarded, without counting: a flat table of bytes is a quarter of CountIn's,
+and filling and zeroing the table is most of the pre-pass.
+*/
+PrepassVector<char> PresentIn(const int sequence[], int N, const int other[], int M) {
+    PrepassVector<char> present(N);
+    if (M == 0) {
+        return present;
+    }
+    int low = *std::min_element(other, other + M);
+    int high = *std::max_element(other, other + M);
+    if (int64_t(high) - low <= 4 * int64_t(N + M) + 1024) {
+        PrepassVector<char> table(size_t(int64_t(high) - low + 1));
+        for (int j = 0; j < M; j++) {
+            table[other[j] - low] = 1;
+        }
+        for (int i = 0; i < N; i++) {
+            present[i] = sequence[i] >= low && sequence[i] <= high ? table[sequence[i] - low] : 0;
+        }
+        return present;
+    }
+    PrepassVector<int> counts = CountIn(sequence, N, other, M);
+    for (int i = 0; i < N; i++) {
+        present[i] = counts[i] != 0;
+    }
+    return present;
+}
+
+// PresentIn for any other element type
+template <typename T>
+PrepassVector<char> PresentIn(const T sequence[], int N, const T other[], int M) {
+    PrepassVector<int> counts = CountIn(sequence, N, other, M);
+    PrepassVector<char> present(N);
+    for (int i = 0; i < N; i++) {
+        present[i] = counts[i] != 0;
+    }
+    return present;
+}
+
+/*
+Decides which elements of a sequence to leave out of the search, given how often each occurs in the other
+sequence ('counts'). Elements that never occur are always left out. With 'confusing' set, elements that occur
+more than a few times (the limit grows slowly with N, as in GNU diff) are left out too, but only from the
+inside of a run of left-out elements, and only while they make up at most a quarter of that run.
+
+@return  One flag per element, set for the elements to keep
+*/
+PrepassVector<char> ChooseKept(const PrepassVector<int>& counts, bool confusing) {
+    int N = int(counts.size());
+    int many = 5;
+    for (int t = N / 64; (t >>= 2) > 0;) {
+        many *= 2;
+    }
+    // 0 keep, 1 discard, 2 discard only if surrounded by discards
+    PrepassVector<char> discard(N);
+    for (int i = 0; i < N; i++) {
+        discard[i] = counts[i] == 0 ? 1 : confusing && counts[i] > many ? 2 : 0;
+    }
+    for (int i = 0; i < N;) {
+        if (!discard[i]) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < N && discard[j]) {
+            j++;
+        }
+        // A run [i, j) of discardable elements: its provisional ends are kept...
+        int first = i, last = j;
+        while (first < last && discard[first] == 2) discard[first++] = 0;
+        while (last > first && discard[last - 1] == 2) discard[--last] = 0;
+        // ...and so is everything provisional inside, unless it is outnumbered three to one
+        int provisional = int(std::count(discard.begin() + first, discard.begin() + last, 2));
+        if (provisional * 4 > last - first) {
+            std::replace(discard.begin() + first, discard.begin() + last, char(2), char(0));
+        }
+        i = j;
+    }
+    PrepassVector<char> keep(N);
+    for (int i = 0; i < N; i++) {
+        keep[i] = !discard[i];
+    }
+    return keep;
+}
+
+// Whether every element of 'sequence' is less than the next
+template <typename T>
+bool IsStrictlySorted(const T sequence[], int N) {
+    for (int i = 1; i < N; i++) {
+        if (!(sequence[i - 1] < sequence[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+The index of the first element of sequence[first, last) that is not less than 'value', for sorted sequences.
+It probes first + 1, first + 2, first + 4, ... before searching between the last two probes, so skipping k
+elements costs O(log k) rather than O(log(last - first)).
+*/
+template <typename T>
+int Gallop(const T sequence[], int first, int last, const T& value) {
+    int bound = first;
+    for (int step = 1; bound < last && sequence[bound] < value; step *= 2) {
+        first = bound + 1;
+        bound = first + step - 1;
+    }
+    return int(std::lower_bound(sequence + first, sequence + std::min(bound, last), value) - sequence);
+}
+
+/*
+The edit script for two strictly increasing sequences. Every element occurs at most once in each, so the
+longest common subsequence is exactly their intersection and the script is unique: a merge of the two that
+deletes what is only in old_sequence and inserts what is only in new_sequence. Runs of elements missing from
+the other side are skipped with Gallop, so long stretches of additions or removals cost little more than
+their output.
+*/
+template <typename T>
+Diff SortedMerge(const T old_sequence[], int N, const T new_sequence[], int M) {
+    Diff rtn;
+    int x = 0, y = 0;
+    while (x < N && y < M) {
+        if (old_sequence[x] < new_sequence[y]) {
+            int end = Gallop(old_sequence, x, N, new_sequence[y]);
+            for (; x < end; x++) {
+                rtn.insert(std::make_pair(x, "del"));
+            }
+        }
+        else if (new_sequence[y] < old_sequence[x]) {
+            int end = Gallop(new_sequence, y, M, old_sequence[x]);
+            for (; y < end; y++) {
+                rtn.insert(std::make_pair(y, "add"));
+            }
+        }
+        else {
+            x++;
+            y++;
+        }
+    }
+    for (; x < N; x++) {
+        rtn.insert(std::make_pair(x, "del"));
+    }
+    for (; y < M; y++) {
+        rtn.insert(std::make_pair(y, "add"));
+    }
+    return rtn;
+}
+
+// The part of a diff from (x, y) spanning N elements of the old sequence and M of the new one
+struct DiffGap {
+    int x, y, N, M;
+};
+
+class ThreadPool;
+
+// Defined after ThreadPool, which it runs the gaps on
+template <typename T>
+Diff DiffGaps(ThreadPool* pool, const T old_sequence[], const T new_sequence[], const std::vector<DiffGap>& gaps,
+              const Options& options, int max_gap = 0);
+
+/*
+The entry point for comparing two whole sequences: ShortestEditScript, plus whatever 'options' asks for
+around it. The result is the same edit script ShortestEditScript returns. Sequences of any element type
+ElementTraits covers can be diffed directly, e.g. uint64_t keys or fixed-size structs.
+*/
+template <typename T>
+Diff DiffSequences(const T old_sequence[], int N, const T new_sequence[], int M, const Options& options = Options()) {
+    if constexpr (std::is_arithmetic<T>::value) {
+        if (options.merge_sorted && IsStrictlySorted(old_sequence, N) && IsStrictlySorted(new_sequence, M)) {
+            return SortedMerge(old_sequence, N, new_sequence, M);
+        }
+    }
+    if (options.memory_limit > 0) {
+        Options rest = options;
+        rest.memory_limit = 0;
+        MemoryBudget own;
+        MemoryBudget* budget = JoinMemoryBudget(own, options.memory_limit);
+        MemoryBudgetScope scope(budget);
+
+        // Leave half of what is left of the budget for whatever the estimate misses
+        long long available = std::max(budget->limit - budget->used.load(), 1LL);
+        long long chunks = std::min((2 * EstimateDiffMemory(N, M, rest) + available - 1) / available, (long long)std::max(std::max(N, M), 1));
+        // The search arrays this thread kept from a larger diff are charged while they are used, so let go of the excess
+        ThreadWorkspace().Trim(int((N + chunks - 1) / chunks + (M + chunks - 1) / chunks));
+        if (chunks <= 1) {
+            return DiffSequences(old_sequence, N, new_sequence, M, rest);
+        }
+        // Too large to search at once: diff matching proportional slices of both sequences one after another
+        std::vector<DiffGap> slices;
+        for (long long c = 0; c < chunks; c++) {
+            int x = int(N * c / chunks), u = int(N * (c + 1) / chunks);
+            int y = int(M * c / chunks), v = int(M * (c + 1) / chunks);
+            slices.push_back(DiffGap{ x, y, u - x, v - y });
+        }
+        return DiffGaps<T>(nullptr, old_sequence, new_sequence, slices, rest);
+    }
+    if ((options.discard_unique || options.discard_confusing) && N > 0 && M > 0) {
+        // Diff only the elements worth searching for, then translate the positions back
+        PrepassVector<char> keep[2];
+        if (options.discard_confusing) {
+            keep[0] = ChooseKept(CountIn(old_sequence, N, new_sequence, M), true);
+            keep[1] = ChooseKept(CountIn(new_sequence, M, old_sequence, N), true);
+        }
+        else {
+            keep[0] = PresentIn(old_sequence, N, new_sequence, M);
+            keep[1] = PresentIn(new_sequence, M, old_sequence, N);
+        }
+        // Only compact the sequences when something is actually left out
+        int kept_count[2] = { int(std::count(keep[0].begin(), keep[0].end(), char(1))), int(std::count(keep[1].begin(), keep[1].end(), char(1))) };
+        if (kept_count[0] < N || kept_count[1] < M) {
+            const T* sequences[2] = { old_sequence, new_sequence };
+            PrepassVector<T> kept[2];
+            PrepassVector<int> index[2];
+            for (int side = 0; side < 2; side++) {
+                kept[side].reserve(kept_count[side]);
+                index[side].reserve(kept_count[side]);
+                for (int i = 0; i < (side ? M : N); i++) {
+                    if (keep[side][i]) {
+                        kept[side].push_back(sequences[side][i]);
+                        index[side].push_back(i);
+                    }
+                }
+            }
+            Options rest = options;
+            rest.discard_unique = false;
+            rest.discard_confusing = false;
+            Diff compacted = DiffSequences(kept[0].data(), int(kept[0].size()), kept[1].data(), int(kept[1].size()), rest);
+            Diff rtn;
+            for (Diff::const_iterator it = compacted.begin(); it != compacted.end(); it++) {
+                rtn.insert(std::make_pair(index[it->second == "add"][it->first], it->second));
+            }
+            for (int i = 0; i < N; i++) {
+                if (!keep[0][i]) rtn.insert(std::make_pair(i, "del"));
+            }
+            for (int j = 0; j < M; j++) {
+                if (!keep[1][j]) rtn.insert(std::make_pair(j, "add"));
+            }
+            return rtn;
+        }
+    }
+
+    MatchRuns runs;
+    bool use_runs = options.match_runs > 0 || (options.match_runs < 0 && HasLongRuns(old_sequence, N, new_sequence, M));
+    if (use_runs) {
+        CountRuns(old_sequence, N, runs.old_forward, runs.old_backward);
+        CountRuns(new_sequence, M, runs.new_forward, runs.new_backward);
+    }
+    // A common prefix and suffix belong to some longest common subsequence, so only what lies between is searched
+    int prefix = CommonPrefix(old_sequence, new_sequence, std::min(N, M));
+    int suffix = CommonSuffix(old_sequence + N, new_sequence + M, std::min(N, M) - prefix);
+    return ShortestEditScript(old_sequence + prefix, N - prefix - suffix, new_sequence + prefix, M - prefix - suffix, prefix, prefix,
+                              use_runs ? &runs : nullptr);
+}
+
+// A maximal run of matching elements (' '), deletions ('-') or insertions ('+') along the edit path
+struct EditRun {
+    char op;
+    int old_pos;
+    int new_pos;
+    int length;
+};
+
+/*
+Walks an edit script produced by 'ShortestEditScript' in path order and calls 'visit' once for every EditRun.
+
+'Diff' keys deletions by their position in old_sequence and insertions by their position in new_sequence, so
+the two kinds interleave in the set in a way that does not follow the path. This function keeps one iterator
+on the next deletion and one on the next insertion, which is enough to rebuild the path without any memory
+beyond the script itself. Where a deletion and an insertion start at the same point, the deletion comes first.
+
+@diff  The edit script for old_sequence (length N) and new_sequence (length M)
+
+@visit  Called with each EditRun, in order
+*/
+template <typename Visitor>
+void ForEachEditRun(const Diff& diff, int N, int M, Visitor visit) {
+    Diff::const_iterator del = diff.begin();
+    Diff::const_iterator add = diff.begin();
+    while (del != diff.end() && del->second != "del") del++;
+    while (add != diff.end() && add->second != "add") add++;
+
+    int x = 0, y = 0;
+    while (x < N || y < M) {
+        EditRun run = { ' ', x, y, 0 };
+        if (del != diff.end() && del->first == x) {
+            run.op = '-';
+            while (del != diff.end() && (del->second != "del" || del->first == x)) {
+                if (del->second == "del") {
+                    run.length++;
+                    x++;
+                }
+                del++;
+            }
+        }
+        else if (add != diff.end() && add->first == y) {
+            run.op = '+';
+            while (add != diff.end() && (add->second != "add" || add->first == y)) {
+                if (add->second == "add") {
+                    run.length++;
+                    y++;
+                }
+                add++;
+            }
+        }
+        else {
+            // Everything up to the next edit on either side is a snake
+            int next_x = del != diff.end() ? del->first : N;
+            int next_y = add != diff.end() ? add->first : M;
+            run.length = std::min(next_x - x, next_y - y);
+            if (run.length <= 0) {
+                // The script does not describe a path through this graph
+                return;
+            }
+            x += run.length;
+            y += run.length;
+        }
+        visit(run);
+    }
+}
+
+/*
+An edit script that is only computed as far as it is read. It runs the same divide and conquer as
+ShortestEditScript, and so yields the same edits, but keeps the subproblems it has not solved yet on a stack
+and always solves the leftmost one first. Reading the first few hunks therefore only pays for the middle
+snakes on the way to them:
+
+    LazyEditScript script(old_sequence, N, new_sequence, M);
+    for (const LazyEditScript::Hunk& hunk : script) {
+        ...
+    }
+
+A hunk is a maximal group of adjacent edits, without context. Both sequences must outlive the script.
+*/
+class LazyEditScript {
+public:
+    struct Hunk {
+        int old_start;
+        int old_length;
+        int new_start;
+        int new_length;
+    };
+
+    LazyEditScript(const int old_sequence[], int N, const int new_sequence[], int M, const MatchRuns* runs = nullptr)
+        : old_sequence_(old_sequence), new_sequence_(new_sequence), runs_(runs), has_next_(false) {
+        stack_.push_back(Subproblem{ 0, 0, N, M });
+    }
+
+    // Computes the next hunk, or returns false when there are none left
+    bool Next(Hunk& hunk) {
+        if (!has_next_ && !NextRun(next_)) {
+            return false;
+        }
+        hunk = Hunk{ next_.old_pos, 0, next_.new_pos, 0 };
+        do {
+            (next_.op == '-' ? hunk.old_length : hunk.new_length) += next_.length;
+            has_next_ = NextRun(next_);
+        } while (has_next_ && next_.old_pos == hunk.old_start + hunk.old_length && next_.new_pos == hunk.new_start + hunk.new_length);
+        return true;
+    }
+
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Hunk value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Hunk* pointer;
+        typedef const Hunk& reference;
+
+        iterator(LazyEditScript* script) : script_(script) {
+            ++*this;
+        }
+        const Hunk& operator*() const { return hunk_; }
+        const Hunk* operator->() const { return &hunk_; }
+        iterator& operator++() {
+            if (script_ && !script_->Next(hunk_)) {
+                script_ = nullptr;
+            }
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return script_ == other.script_; }
+        bool operator!=(const iterator& other) const { return script_ != other.script_; }
+
+    private:
+        LazyEditScript* script_;
+        Hunk hunk_;
+    };
+
+    // Iterating moves through the script, so it can only be done once
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(nullptr); }
+
+private:
+    // The part of the edit graph from (x, y) spanning N elements of old_sequence and M of new_sequence
+    struct Subproblem {
+        int x, y, N, M;
+    };
+
+    // Splits the leftmost subproblems, exactly as ShortestEditScript would, until one is a run of edits
+    bool NextRun(EditRun& run) {
+        const std::atomic<bool>* cancel = ThreadWorkspace().cancel;
+        while (!stack_.empty()) {
+            if (cancel && *cancel) {
+                throw DiffCancelled();
+            }
+            Subproblem s = stack_.back();
+            stack_.pop_back();
+            if (s.N > 0 && s.M > 0) {
+                int D, x, y, u, v;
+                std::tie(D, x, y, u, v) = FindMiddleSnake(old_sequence_ + s.x, s.N, new_sequence_ + s.y, s.M, runs_, s.x, s.y);
+                if (D > 1 || (x != u && y != v)) {
+                    stack_.push_back(Subproblem{ s.x + u, s.y + v, s.N - u, s.M - v });
+                    stack_.push_back(Subproblem{ s.x, s.y, x, y });
+                }
+                else if (s.M > s.N) {
+                    stack_.push_back(Subproblem{ s.x + s.N, s.y + s.N, 0, s.M - s.N });
+                }
+                else if (s.M < s.N) {
+                    stack_.push_back(Subproblem{ s.x + s.M, s.y + s.M, s.N - s.M, 0 });
+                }
+            }
+            else if (s.N > 0) {
+                run = EditRun{ '-', s.x, s.y, s.N };
+                return true;
+            }
+            else if (s.M > 0) {
+                run = EditRun{ '+', s.x, s.y, s.M };
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const int* old_sequence_;
+    const int* new_sequence_;
+    const MatchRuns* runs_;
+    std::vector<Subproblem> stack_;
+    // The run read ahead to find where the current hunk ends
+    EditRun next_;
+    bool has_next_;
+};
+
+/*
+Walks 'script' as far as it has to, in path order, and calls 'visit' once for every EditRun, as ForEachEditRun
+does for a whole Diff. Within a hunk the deletions come before the insertions. Only the hunk being walked is
+in memory, so a report or listing written this way never holds the whole script.
+*/
+template <typename Visitor>
+void ForEachEditRun(LazyEditScript& script, int N, int M, Visitor visit) {
+    int x = 0, y = 0;
+    for (const LazyEditScript::Hunk& hunk : script) {
+        if (hunk.old_start > x) {
+            visit(EditRun{ ' ', x, y, hunk.old_start - x });
+        }
+        if (hunk.old_length > 0) {
+            visit(EditRun{ '-', hunk.old_start, hunk.new_start, hunk.old_length });
+        }
+        if (hunk.new_length > 0) {
+            visit(EditRun{ '+', hunk.old_start + hunk.old_length, hunk.new_start, hunk.new_length });
+        }
+        x = hunk.old_start + hunk.old_length;
+        y = hunk.new_start + hunk.new_length;
+    }
+    if (x < N && y < M) {
+        visit(EditRun{ ' ', x, y, std::min(N - x, M - y) });
+    }
+}
+
+/*
+Writes 'diff' as one record per edit, in path order, in the form
+
+    {del, pos_old: <x> val: <old_sequence[x]>}
+    {add, pos_old: <x> pos_new: <y> val: <new_sequence[y]>}
+
+where 'pos_old' of an insertion is the position in old_sequence before which the element is inserted.
+*/
+void WriteEditScript(std::ostream& out, const int old_sequence[], int N, const int new_sequence[], int M, const Diff& diff) {
+    ForEachEditRun(diff, N, M, [&](const EditRun& run) {
+        for (int i = 0; i < run.length && run.op == '-'; i++) {
+            out << "{del, pos_old: " << run.old_pos + i << " val: " << old_sequence[run.old_pos + i] << "}\n";
+        }
+        for (int i = 0; i < run.length && run.op == '+'; i++) {
+            out << "{add, pos_old: " << run.old_pos << " pos_new: " << run.new_pos + i << " val: " << new_sequence[run.new_pos + i] << "}\n";
+        }
+    });
+}
+
+// 'text' as a double-quoted JavaScript (and JSON) string literal that is also safe inside an HTML <script>
+std::string JsString(const std::string& text) {
+    std::string quoted = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += char(c);
+        }
+        else if (c < 0x20 || c == 0x7f || c == '<' || c == '>' || c == '&') {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else {
+            quoted += char(c);
+        }
+    }
+    return quoted + "\"";
+}
+
+/*
+Writes an HTML report of a diff that stays small enough for a browser to open no matter how large the diff is.
+
+The page at 'path' has a fixed size: the totals and a viewer that shows one page of hunks at a time. The hunks,
+both the summary line and the lines of each, go into side files next to it named '<path>.chunk<k>.js',
+'hunks_per_chunk' hunks per file, one file per page. A page is only loaded (as a script, so that the report
+also works when opened from disk) when it is shown, and only the page shown is kept.
+
+'script' is a Diff or a LazyEditScript, whatever ForEachEditRun walks; with a LazyEditScript the script is
+computed as it is written and never held whole. Everything is written in one pass over the edit runs. Only
+the hunk being written is kept in memory, and only its line counts, since the lines go straight to the chunk
+file.
+
+@text  Turns an element into the text shown for it, e.g. LineInterner::Text for interned lines; by default the
+value itself is shown. The text is escaped, so it may hold anything.
+
+@context  The number of matching elements shown around each change
+
+@return  false if any of the files could not be written
+*/
+template <typename Script>
+bool WriteHtmlReport(const int old_sequence[], int N, const int new_sequence[], int M, Script& script,
+                     const std::string& path, const std::function<std::string(int)>& text = nullptr, int context = 3,
+                     int hunks_per_chunk = 64) {
+    std::ofstream chunk;
+    int hunks = 0;
+    long long total_dels = 0, total_adds = 0;
+    bool open = false;
+    int old_start = 0, new_start = 0, old_len = 0, new_len = 0, dels = 0, adds = 0;
+    // The trailing part of the last snake, which becomes the leading context of the next hunk
+    int lead_x = 0, lead_y = 0, lead_len = 0;
+    bool ok = true;
+
+    auto emit = [&](char op, int value) {
+        chunk << (old_len + new_len > 0 ? ", " : "") << JsString(op + (text ? text(value) : std::to_string(value)));
+        if (op != '+') old_len++;
+        if (op != '-') new_len++;
+    };
+    auto open_hunk = [&]() {
+        if (hunks % hunks_per_chunk == 0) {
+            chunk.open(path + ".chunk" + std::to_string(hunks / hunks_per_chunk) + ".js");
+            ok = ok && chunk.good();
+            chunk << "myersChunk(" << hunks / hunks_per_chunk << ", [";
+        }
+        chunk << (hunks % hunks_per_chunk ? ",\n" : "\n") << "{lines: [";
+        open = true;
+        old_start = lead_x;
+        new_start = lead_y;
+        old_len = new_len = dels = adds = 0;
+        for (int i = 0; i < lead_len; i++) {
+            emit(' ', old_sequence[lead_x + i]);
+        }
+    };
+    auto close_hunk = [&]() {
+        chunk << "], summary: " << JsString("@@ -" + std::to_string(old_start + 1) + "," + std::to_string(old_len) + " +" +
+                                            std::to_string(new_start + 1) + "," + std::to_string(new_len) + " @@ " +
+                                            std::to_string(dels) + " deletions, " + std::to_string(adds) + " insertions") << "}";
+        open = false;
+        hunks++;
+        total_dels += dels;
+        total_adds += adds;
+        if (hunks % hunks_per_chunk == 0) {
+            chunk << "\n]);\n";
+            chunk.close();
+            ok = ok && !chunk.fail();
+        }
+    };
+
+    ForEachEditRun(script, N, M, [&](const EditRun& run) {
+        if (run.op == ' ') {
+            bool last = run.old_pos + run.length == N && run.new_pos + run.length == M;
+            int trail = 0;
+            if (open) {
+                trail = run.length <= 2 * context && !last ? run.length : std::min(context, run.length);
+                for (int i = 0; i < trail; i++) {
+                    emit(' ', old_sequence[run.old_pos + i]);
+                }
+                if (trail < run.length || last) {
+                    close_hunk();
+                }
+            }
+            lead_len = open ? 0 : std::min(context, run.length - trail);
+            lead_x = run.old_pos + run.length - lead_len;
+            lead_y = run.new_pos + run.length - lead_len;
+            return;
+        }
+        if (!open) {
+            if (lead_len == 0) {
+                lead_x = run.old_pos;
+                lead_y = run.new_pos;
+            }
+            open_hunk();
+            lead_len = 0;
+        }
+        for (int i = 0; i < run.length; i++) {
+            if (run.op == '-') {
+                emit('-', old_sequence[run.old_pos + i]);
+                dels++;
+            }
+            else {
+                emit('+', new_sequence[run.new_pos + i]);
+                adds++;
+            }
+        }
+    });
+    if (open) {
+        close_hunk();
+    }
+    if (hunks % hunks_per_chunk != 0) {
+        chunk << "\n]);\n";
+        chunk.close();
+        ok = ok && !chunk.fail();
+    }
+
+    // Written last, when the totals are known; its size does not depend on the diff
+    std::ofstream index(path);
+    std::string chunk_name = path.substr(path.find_last_of("/\\") + 1) + ".chunk";
+    index << "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>diff</title>\n"
+             "<style>body{font-family:monospace}summary{cursor:pointer}.d{background:#fdd}.a{background:#dfd}</style>\n"
+             "</head><body>\n"
+             "<p>" << hunks << " hunks, " << total_dels << " deletions, " << total_adds << " insertions</p>\n"
+             "<p><button onclick=\"go(page - 1)\">previous</button> <span id=\"where\"></span> "
+             "<button onclick=\"go(page + 1)\">next</button> hunk <input id=\"hunk\" type=\"number\" min=\"1\" "
+             "onchange=\"go(Math.floor((this.value - 1) / perChunk))\"></p>\n"
+             "<div id=\"hunks\"></div>\n"
+             "<script>\n"
+             "var total = " << hunks << ", perChunk = " << hunks_per_chunk << ", page = -1;\n"
+             "function myersChunk(k, hunks) {\n"
+             "  if (k != page) return;\n"
+             "  var box = document.getElementById('hunks');\n"
+             "  box.textContent = '';\n"
+             "  hunks.forEach(function (hunk) {\n"
+             "    var d = document.createElement('details'), s = document.createElement('summary'), body = document.createElement('pre');\n"
+             "    s.textContent = hunk.summary;\n"
+             "    d.appendChild(s);\n"
+             "    d.appendChild(body);\n"
+             "    d.ontoggle = function () {\n"
+             "      if (!d.open || body.childNodes.length) return;\n"
+             "      hunk.lines.forEach(function (line) {\n"
+             "        var e = document.createElement('div');\n"
+             "        e.className = line[0] == '-' ? 'd' : line[0] == '+' ? 'a' : '';\n"
+             "        e.textContent = line;\n"
+             "        body.appendChild(e);\n"
+             "      });\n"
+             "    };\n"
+             "    box.appendChild(d);\n"
+             "  });\n"
+             "}\n"
+             "function go(k) {\n"
+             "  if (!(k >= 0 && k * perChunk < total) || k == page) return;\n"
+             "  page = k;\n"
+             "  document.getElementById('where').textContent = 'hunks ' + (k * perChunk + 1) + '-' + Math.min(total, (k + 1) * perChunk) + ' of ' + total;\n"
+             "  var s = document.createElement('script');\n"
+             "  s.src = " << JsString(chunk_name) << " + k + '.js';\n"
+             "  s.onload = s.onerror = function () { s.remove(); };\n"
+             "  document.head.appendChild(s);\n"
+             "}\n"
+             "go(0);\n"
+             "</script></body></html>\n";
+    index.close();
+    return ok && !index.fail();
+}
+
+#ifdef MYERS_WITH_ZSTD
+/*
+A stream buffer that zstd-compresses everything written through it into 'sink', so any of the formatters above
+can write compressed output directly:
+
+    ZstdOutputBuffer buffer(file, 3, 4);
+    std::ostream out(&buffer);
+    WriteEditScript(out, ...);
+
+With 'workers' > 0 zstd compresses on that many background threads. Each write only hands the data over and
+returns, so formatting keeps going while earlier blocks are still being compressed. The frame is finished when
+the buffer is destroyed; 'sync' (std::flush) only flushes the blocks written so far.
+*/
+class ZstdOutputBuffer : public std::streambuf {
+public:
+    ZstdOutputBuffer(std::ostream& sink, int level = 3, int workers = 0)
+        : sink_(sink), cctx_(ZSTD_createCCtx()), in_(ZSTD_CStreamInSize()), out_(ZSTD_CStreamOutSize()) {
+        ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level);
+        // Fails harmlessly (compression stays single threaded) when libzstd was built without threads
+        ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, workers);
+        setp(in_.data(), in_.data() + in_.size());
+    }
+
+    virtual ~ZstdOutputBuffer() {
+        Compress(ZSTD_e_end);
+        ZSTD_freeCCtx(cctx_);
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!Compress(ZSTD_e_continue)) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        return Compress(ZSTD_e_flush) && sink_.flush() ? 0 : -1;
+    }
+
+private:
+    // Hands the buffered input to zstd and writes out whatever it produces
+    bool Compress(ZSTD_EndDirective mode) {
+        ZSTD_inBuffer input = { pbase(), size_t(pptr() - pbase()), 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer output = { out_.data(), out_.size(), 0 };
+            remaining = ZSTD_compressStream2(cctx_, &output, &input, mode);
+            if (ZSTD_isError(remaining)) {
+                return false;
+            }
+            sink_.write(out_.data(), output.pos);
+        } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+        setp(in_.data(), in_.data() + in_.size());
+        return bool(sink_);
+    }
+
+    std::ostream& sink_;
+    ZSTD_CCtx* cctx_;
+    std::vector<char> in_;
+    std::vector<char> out_;
+};
+
+/*
+The reading side of ZstdOutputBuffer: decompresses 'source' as it is read, one block at a time, so a
+compressed input never has to be decompressed up front. Concatenated frames are read as one stream.
+*/
+class ZstdInputBuffer : public std::streambuf {
+public:
+    ZstdInputBuffer(std::istream& source)
+        : source_(source), dctx_(ZSTD_createDCtx()), in_(ZSTD_DStreamInSize()), out_(ZSTD_DStreamOutSize()), input_{ in_.data(), 0, 0 } {
+        setg(out_.data(), out_.data(), out_.data());
+    }
+
+    virtual ~ZstdInputBuffer() {
+        ZSTD_freeDCtx(dctx_);
+    }
+
+    // Whether everything read so far decoded cleanly and ended at the end of a frame
+    bool Finished() const {
+        return status_ == 0;
+    }
+
+protected:
+    int_type underflow() override {
+        ZSTD_outBuffer output = { out_.data(), out_.size(), 0 };
+        while (output.pos == 0) {
+            if (input_.pos == input_.size) {
+                source_.read(in_.data(), in_.size());
+                input_ = { in_.data(), size_t(source_.gcount()), 0 };
+                if (input_.size == 0) {
+                    return traits_type::eof();
+                }
+            }
+            status_ = ZSTD_decompressStream(dctx_, &output, &input_);
+            if (ZSTD_isError(status_)) {
+                return traits_type::eof();
+            }
+        }
+        setg(out_.data(), out_.data(), out_.data() + output.pos);
+        return traits_type::to_int_type(out_[0]);
+    }
+
+private:
+    std::istream& source_;
+    ZSTD_DCtx* dctx_;
+    std::vector<char> in_;
+    std::vector<char> out_;
+    ZSTD_inBuffer input_;
+    // What the last ZSTD_decompressStream returned: 0 at the end of a frame
+    size_t status_ = 0;
+};
+#endif
+
+/*
+NUMA placement for worker threads. Linux puts a page on the node of the thread that first writes to it, so a
+worker that is pinned to one node and allocates and fills its own buffers (its V arrays, the ids of the files
+it reads) gets node-local memory without any explicit placement. What goes wrong on multi-socket machines is
+workers drifting between nodes, so the parallel paths pin worker t to node t % NumaNodeCount().
+
+Built without MYERS_WITH_NUMA (which needs -lnuma) these report a single node and do nothing.
+*/
+int NumaNodeCount() {
+#ifdef MYERS_WITH_NUMA
+    if (numa_available() >= 0) {
+        return std::max(1, numa_num_configured_nodes());
+    }
+#endif
+    return 1;
+}
+
+// Restricts the calling thread to the CPUs of 'node' and makes its allocations prefer that node
+void PinThreadToNode(int node) {
+#ifdef MYERS_WITH_NUMA
+    if (numa_available() >= 0 && node < numa_num_configured_nodes()) {
+        numa_run_on_node(node);
+        numa_set_preferred(node);
+    }
+#else
+    (void)node;
+#endif
+}
+
+// How many of the sampled pages of worker buffers were found on the worker's own node
+struct NumaStats {
+    std::atomic<long long> local_pages{ 0 };
+    std::atomic<long long> remote_pages{ 0 };
+};
+
+NumaStats& GlobalNumaStats() {
+    static NumaStats stats;
+    return stats;
+}
+
+/*
+Samples up to 'samples' pages of the buffer at 'data' and counts them as local or remote to the node the
+calling thread is running on.
+*/
+void RecordNumaPlacement(const void* data, size_t bytes, int samples = 16) {
+#ifdef MYERS_WITH_NUMA
+    if (numa_available() < 0 || bytes == 0) {
+        return;
+    }
+    int node = numa_node_of_cpu(sched_getcpu());
+    uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    uintptr_t first = uintptr_t(data) & ~(page - 1);
+    uintptr_t pages = (uintptr_t(data) + bytes - first + page - 1) / page;
+    uintptr_t stride = std::max<uintptr_t>(1, pages / samples);
+    std::vector<void*> addresses;
+    for (uintptr_t i = 0; i < pages; i += stride) {
+        addresses.push_back(reinterpret_cast<void*>(first + i * page));
+    }
+    std::vector<int> status(addresses.size());
+    // With no target nodes, move_pages only reports where each page currently is
+    if (move_pages(0, addresses.size(), addresses.data(), nullptr, status.data(), 0) != 0) {
+        return;
+    }
+    for (int page_node : status) {
+        if (page_node >= 0) {
+            (page_node == node ? GlobalNumaStats().local_pages : GlobalNumaStats().remote_pages)++;
+        }
+    }
+#else
+    (void)data;
+    (void)bytes;
+    (void)samples;
+#endif
+}
+
+/*
+A work-stealing thread pool for running diffs in parallel. Every worker keeps its own task deque: tasks
+submitted from inside a worker go to the front of its own deque and are run newest first, tasks from other
+threads are dealt out round robin, and a worker that runs dry takes the oldest task from another worker.
+
+Each worker diffs with its own ThreadWorkspace, which survives from one task to the next, so a long-running
+pool stops allocating V arrays once it has seen its largest problem.
+
+@threads  The number of workers, or 0 for one per hardware thread
+
+@cpus  If not empty, worker i is pinned to CPU cpus[i % cpus.size()]. Otherwise, on a machine with several
+NUMA nodes, worker i is pinned to node i % NumaNodeCount().
+
+@inline_cutoff  SubmitDiff runs problems with N + M below this on the calling thread, where handing them to
+a worker would cost more than the diff itself
+*/
+class ThreadPool {
+public:
+    ThreadPool(int threads = 0, const std::vector<int>& cpus = std::vector<int>(), int inline_cutoff = 1024)
+        : workers_(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())), inline_cutoff_(inline_cutoff),
+          next_(0), pending_(0), stop_(false) {
+        for (size_t i = 0; i < workers_.size(); i++) {
+            workers_[i].reset(new Worker());
+        }
+        for (size_t i = 0; i < workers_.size(); i++) {
+            workers_[i]->thread = std::thread([this, i, cpus]() {
+                if (!cpus.empty()) {
+                    PinThreadToCpu(cpus[i % cpus.size()]);
+                }
+                else if (NumaNodeCount() > 1) {
+                    PinThreadToNode(int(i) % NumaNodeCount());
+                }
+                Run(i);
+            });
+        }
+    }
+
+    // Runs every task already submitted, then stops the workers
+    virtual ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::unique_ptr<Worker>& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int Size() const {
+        return int(workers_.size());
+    }
+
+    // Runs 'task' on one of the workers
+    template <typename Task>
+    std::future<decltype(std::declval<Task>()())> Submit(Task task) {
+        typedef decltype(task()) Result;
+        std::shared_ptr<std::packaged_task<Result()>> packaged = std::make_shared<std::packaged_task<Result()>>([task = std::move(task)]() mutable {
+            // What the task allocated is merged before its result is published, so whoever waits for it sees it
+            MergeAllocationsOnExit merge;
+            return task();
+        });
+        std::future<Result> result = packaged->get_future();
+        Push([packaged]() { (*packaged)(); });
+        return result;
+    }
+
+    // DiffSequences on a worker. Both sequences must stay alive until the future is ready.
+    std::future<Diff> SubmitDiff(const int old_sequence[], int N, const int new_sequence[], int M, const Options& options = Options()) {
+        if (N + M < inline_cutoff_) {
+            // A failure is reported through the future, as it is for a diff run on a worker
+            std::promise<Diff> done;
+            try {
+                done.set_value(DiffSequences(old_sequence, N, new_sequence, M, options));
+            }
+            catch (...) {
+                done.set_exception(std::current_exception());
+            }
+            return done.get_future();
+        }
+        return Submit([=]() { return DiffSequences(old_sequence, N, new_sequence, M, options); });
+    }
+
+private:
+    struct MergeAllocationsOnExit {
+        ~MergeAllocationsOnExit() {
+            ThreadAllocations().Merge();
+        }
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    static void PinThreadToCpu(int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu;
+#endif
+    }
+
+    // The index of the worker running on this thread, or -1 for threads outside this pool
+    int& CurrentWorker() {
+        thread_local std::map<const ThreadPool*, int> index;
+        std::map<const ThreadPool*, int>::iterator it = index.find(this);
+        return it != index.end() ? it->second : index.insert(std::make_pair(this, -1)).first->second;
+    }
+
+    void Push(std::function<void()> task) {
+        int own = CurrentWorker();
+        Worker& worker = *workers_[own >= 0 ? size_t(own) : next_++ % workers_.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (own >= 0) {
+                worker.tasks.push_front(std::move(task));
+            }
+            else {
+                worker.tasks.push_back(std::move(task));
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_++;
+        }
+        wake_.notify_one();
+    }
+
+    // Takes the newest task of worker 'index', or failing that the oldest task of any other worker
+    bool Pop(size_t index, std::function<void()>& task) {
+        for (size_t i = 0; i < workers_.size(); i++) {
+            Worker& worker = *workers_[(index + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (!worker.tasks.empty()) {
+                if (i == 0) {
+                    task = std::move(worker.tasks.front());
+                    worker.tasks.pop_front();
+                }
+                else {
+                    task = std::move(worker.tasks.back());
+                    worker.tasks.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(size_t index) {
+        CurrentWorker() = int(index);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this]() { return pending_ > 0 || stop_; });
+                if (pending_ == 0) {
+                    return;
+                }
+                pending_--;
+            }
+            // A task was counted, so one of the deques holds one for us
+            std::function<void()> task;
+            while (!Pop(index, task)) {
+                std::this_thread::yield();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    int inline_cutoff_;
+    std::atomic<size_t> next_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    size_t pending_;
+    bool stop_;
+};
+
+/*
+Waits for every one of 'tasks', then rethrows the first failure, if any. Tasks that use the caller's frame
+must all have finished before it returns, or unwinds.
+*/
+void WaitAll(std::vector<std::future<void>>& tasks) {
+    std::exception_ptr error;
+    for (std::future<void>& task : tasks) {
+        try {
+            task.get();
+        }
+        catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+Diffs the 'gaps' of two sequences, each on its own, and returns the script for the whole: every element
+outside the gaps is matched. The gaps must be in order and must not overlap. With a 'pool' the gaps are
+diffed concurrently on it, and this blocks until done, so it must not be called from one of the pool's own
+workers; without one they are diffed one after another on this thread. If a gap fails, the first exception
+is rethrown once every gap has finished. The gaps are charged to the caller's MemoryBudget, if it has one.
+
+A gap of more than 'max_gap' elements in all (if not 0) is not searched, and all of it is replaced, where a
+search would be quadratic in a gap that has nothing in common.
+*/
+template <typename T>
+Diff DiffGaps(ThreadPool* pool, const T old_sequence[], const T new_sequence[], const std::vector<DiffGap>& gaps,
+              const Options& options, int max_gap) {
+    auto diff_gap = [&](const DiffGap& gap) {
+        if (max_gap > 0 && (long long)gap.N + gap.M > max_gap) {
+            Diff rtn;
+            for (int i = 0; i < gap.N; i++) {
+                rtn.insert(std::make_pair(i, "del"));
+            }
+            for (int j = 0; j < gap.M; j++) {
+                rtn.insert(std::make_pair(j, "add"));
+            }
+            return rtn;
+        }
+        return DiffSequences(old_sequence + gap.x, gap.N, new_sequence + gap.y, gap.M, options);
+    };
+    Diff rtn;
+    auto merge = [&rtn](const Diff& piece, const DiffGap& gap) {
+        for (Diff::const_iterator it = piece.begin(); it != piece.end(); it++) {
+            rtn.insert(std::make_pair(it->first + (it->second == "del" ? gap.x : gap.y), it->second));
+        }
+    };
+    if (!pool) {
+        for (const DiffGap& gap : gaps) {
+            merge(diff_gap(gap), gap);
+        }
+        return rtn;
+    }
+    // The gaps are charged to the same budget as the caller
+    MemoryBudget* budget = ThreadMemoryBudget();
+    std::vector<std::future<Diff>> pieces;
+    for (const DiffGap& gap : gaps) {
+        pieces.push_back(pool->Submit([&diff_gap, gap, budget]() {
+            MemoryBudgetScope scope(budget);
+            return diff_gap(gap);
+        }));
+    }
+    // The tasks use diff_gap and the sequences, so every one is waited for even after a failure
+    std::exception_ptr error;
+    for (size_t g = 0; g < gaps.size(); g++) {
+        try {
+            Diff piece = pieces[g].get();
+            if (!error) {
+                merge(piece, gaps[g]);
+            }
+        }
+        catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return rtn;
+}
+
+/*
+Hands the pieces of an edit script that is computed out of order to a sink in order. The script is split into
+'size' slots numbered in path order; a piece covers slots [first, end), and is passed on as soon as every
+slot before it has been. Completing a piece never blocks: whichever thread finds the next piece ready
+delivers it, and a thread that finds another one already delivering leaves it to that thread.
+*/
+class ReorderBuffer {
+public:
+    ReorderBuffer(int size, std::function<void(const Diff&)> sink, std::function<void()> finished)
+        : slots_(size), sink_(std::move(sink)), finished_(std::move(finished)), cursor_(0), delivering_(false) {
+        for (std::atomic<Piece*>& slot : slots_) {
+            slot = nullptr;
+        }
+    }
+
+    virtual ~ReorderBuffer() {
+        for (std::atomic<Piece*>& slot : slots_) {
+            delete slot.load();
+        }
+    }
+
+    void Complete(int first, int end, Diff edits) {
+        slots_[first] = new Piece{ end, std::move(edits) };
+        for (;;) {
+            bool idle = false;
+            if (!delivering_.compare_exchange_strong(idle, true)) {
+                return;
+            }
+            int cursor = cursor_;
+            while (cursor < int(slots_.size()) && slots_[cursor].load()) {
+                // Owned here, so a sink that throws does not leak the piece
+                std::unique_ptr<Piece> piece(slots_[cursor].exchange(nullptr));
+                sink_(piece->edits);
+                cursor = piece->end;
+            }
+            cursor_ = cursor;
+            delivering_ = false;
+            if (cursor == int(slots_.size())) {
+                finished_();
+                return;
+            }
+            // A piece completed while we were finishing up would otherwise be left waiting
+            if (!slots_[cursor].load()) {
+                return;
+            }
+        }
+    }
+
+private:
+    struct Piece {
+        int end;
+        Diff edits;
+    };
+
+    std::vector<std::atomic<Piece*>> slots_;
+    std::function<void(const Diff&)> sink_;
+    std::function<void()> finished_;
+    std::atomic<int> cursor_;
+    std::atomic<bool> delivering_;
+};
+
+/*
+ShortestEditScript with the recursion spread over 'pool': once a middle snake is found, the subproblems on
+either side of it are independent and become separate tasks. Each subproblem carries its place in the path
+(the slots it covers in a ReorderBuffer), so the edits reach 'sink' in path order, one piece at a time, while
+the rest of the recursion is still running. Together the pieces are exactly the ShortestEditScript result.
+
+Only the top 'depth' levels of the recursion are split into tasks; below that a subproblem is solved with
+ShortestEditScript on one worker. 'sink' is called on the pool's workers, never two at a time. This blocks
+until the whole script has been delivered, so it must not be called from one of the pool's own workers.
+If a piece fails, the first exception is rethrown, but only after every task already submitted has returned,
+since they all still use the sequences and 'sink'.
+*/
+void ParallelEditScript(ThreadPool& pool, const int old_sequence[], int N, const int new_sequence[], int M,
+                        std::function<void(const Diff&)> sink, int depth = 8, const MatchRuns* runs = nullptr) {
+    struct State {
+        std::unique_ptr<ReorderBuffer> buffer;
+        std::mutex mutex;
+        std::condition_variable drained;
+        // Tasks submitted to the pool that have not returned yet
+        int outstanding = 0;
+        std::exception_ptr error;
+        // Set once a piece has failed, so that the tasks still queued do no more work
+        std::atomic<bool> failed{ false };
+        std::function<void(int, int, int, int, int, int)> solve;
+        std::function<void(int, int, int, int, int, int)> spawn;
+    } state;
+    state.buffer.reset(new ReorderBuffer(1 << depth, std::move(sink), []() {}));
+
+    // Solves the part of the graph from (x, y) spanning n by m elements, which covers slots [first, end)
+    state.solve = [&state, old_sequence, new_sequence, runs](int x, int y, int n, int m, int first, int end) {
+        if (state.failed) {
+            return;
+        }
+        try {
+            if (end - first > 1 && n > 0 && m > 0) {
+                int D, sx, sy, u, v;
+                std::tie(D, sx, sy, u, v) = FindMiddleSnake(old_sequence + x, n, new_sequence + y, m, runs, x, y);
+                if (D > 1 || (sx != u && sy != v)) {
+                    int middle = first + (end - first) / 2;
+                    state.spawn(x, y, sx, sy, first, middle);
+                    state.spawn(x + u, y + v, n - u, m - v, middle, end);
+                    return;
+                }
+            }
+            state.buffer->Complete(first, end, ShortestEditScript(old_sequence + x, n, new_sequence + y, m, x, y, runs));
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (!state.error) {
+                state.error = std::current_exception();
+            }
+            state.failed = true;
+        }
+    };
+    // Runs solve as a pool task, counted in 'outstanding' until it returns
+    state.spawn = [&state, &pool](int x, int y, int n, int m, int first, int end) {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.outstanding++;
+        }
+        std::function<void()> finish = [&state]() {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (--state.outstanding == 0) {
+                state.drained.notify_all();
+            }
+        };
+        try {
+            pool.Submit([&state, x, y, n, m, first, end, finish]() {
+                state.solve(x, y, n, m, first, end);
+                // The caller may read the allocation counts as soon as the last task finishes
+                ThreadAllocations().Merge();
+                finish();
+            });
+        }
+        catch (...) {
+            finish();
+            throw;
+        }
+    };
+    state.spawn(0, 0, N, M, 0, 1 << depth);
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.drained.wait(lock, [&state]() { return state.outstanding == 0; });
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+}
+
+/*
+An order-insensitive diff: compares 'old_sequence' and 'new_sequence' as multisets, for collections whose
+order carries no meaning (key sets, configuration entries). An element that occurs a times in old_sequence
+and b times in new_sequence is matched min(a, b) times, earliest occurrences first, and its remaining
+occurrences are deletions (a > b) or insertions (b > a). The result keys them as ShortestEditScript does,
+but it is not an edit path: the elements that are kept need not be in the same order on both sides.
+
+The work is linear and spread over 'pool'. Elements are split into 'partitions' (by default one per
+worker) by hash, each partition is counted in its own hash table, and the partitions' edits are merged
+into one script at the end. Like ParallelEditScript, this blocks until done, so it must not be called from
+one of the pool's own workers.
+*/
+template <typename T>
+Diff UnorderedDiff(ThreadPool& pool, const T old_sequence[], int N, const T new_sequence[], int M, int partitions = 0) {
+    int P = partitions > 0 ? partitions : std::max(1, int(std::thread::hardware_concurrency()));
+    // Partition by the high bits of a remixed hash, so the tables within a partition still see spread-out hashes
+    auto partition_of = [P](const T& element) {
+        uint64_t hash = uint64_t(ElementTraits<T>::Hash(element)) * 0x9E3779B97F4A7C15ull;
+        return int(((hash >> 32) * uint64_t(P)) >> 32);
+    };
+
+    // First pass: each of P slices of the inputs sorts its indexes into per-partition lists, still in order
+    const T* sequences[2] = { old_sequence, new_sequence };
+    int lengths[2] = { N, M };
+    std::vector<std::vector<std::vector<int>>> indexes[2];
+    for (int side = 0; side < 2; side++) {
+        indexes[side].assign(P, std::vector<std::vector<int>>(P));
+    }
+    std::vector<std::future<void>> scanned;
+    for (int slice = 0; slice < P; slice++) {
+        scanned.push_back(pool.Submit([&, slice]() {
+            for (int side = 0; side < 2; side++) {
+                int first = int(int64_t(lengths[side]) * slice / P), last = int(int64_t(lengths[side]) * (slice + 1) / P);
+                for (int i = first; i < last; i++) {
+                    indexes[side][slice][partition_of(sequences[side][i])].push_back(i);
+                }
+            }
+        }));
+    }
+    WaitAll(scanned);
+
+    // Second pass: each partition counts its elements on both sides, then matches occurrences in order
+    std::vector<std::vector<int>> deleted(P), added(P);
+    std::vector<std::future<void>> counted;
+    for (int part = 0; part < P; part++) {
+        counted.push_back(pool.Submit([&, part]() {
+            struct Counts {
+                int old_count = 0;
+                int new_count = 0;
+            };
+            std::unordered_map<T, Counts, ElementHash<T>, ElementEqual<T>> table;
+            for (int slice = 0; slice < P; slice++) {
+                for (int i : indexes[0][slice][part]) table[old_sequence[i]].old_count++;
+                for (int j : indexes[1][slice][part]) table[new_sequence[j]].new_count++;
+            }
+            // Each side consumes the other's count, so whatever is left over is an edit
+            for (int slice = 0; slice < P; slice++) {
+                for (int i : indexes[0][slice][part]) {
+                    Counts& counts = table.find(old_sequence[i])->second;
+                    if (counts.new_count > 0) {
+                        counts.new_count--;
+                    }
+                    else {
+                        deleted[part].push_back(i);
+                    }
+                }
+            }
+            for (int slice = 0; slice < P; slice++) {
+                for (int j : indexes[1][slice][part]) {
+                    Counts& counts = table.find(new_sequence[j])->second;
+                    if (counts.old_count > 0) {
+                        counts.old_count--;
+                    }
+                    else {
+                        added[part].push_back(j);
+                    }
+                }
+            }
+        }));
+    }
+    WaitAll(counted);
+
+    // Merge the partitions' edits and insert them in key order, so every insertion lands at the end
+    std::vector<int> dels, adds;
+    for (int part = 0; part < P; part++) {
+        dels.insert(dels.end(), deleted[part].begin(), deleted[part].end());
+        adds.insert(adds.end(), added[part].begin(), added[part].end());
+    }
+    std::sort(dels.begin(), dels.end());
+    std::sort(adds.begin(), adds.end());
+    Diff rtn;
+    size_t d = 0, a = 0;
+    while (d < dels.size() || a < adds.size()) {
+        // At equal positions "add" sorts before "del"
+        if (a < adds.size() && (d == dels.size() || adds[a] <= dels[d])) {
+            rtn.insert(rtn.end(), std::make_pair(adds[a++], "add"));
+        }
+        else {
+            rtn.insert(rtn.end(), std::make_pair(dels[d++], "del"));
+        }
+    }
+    return rtn;
+}
+
+/*
+A diff in which chosen elements must line up, like git's '--anchored'. An element is an anchor when
+'is_anchor' accepts it and it occurs exactly once in each sequence; each such pair is matched, and the
+stretches between consecutive anchors are diffed as independent subproblems, concurrently on 'pool'. Besides
+keeping section headers and the like aligned, this cuts one large search into many small ones.
+
+The anchors must occur in the same order in both sequences, since matched pairs cannot cross; otherwise this
+throws std::invalid_argument naming the first pair out of order. Options::memory_limit bounds the anchor
+search and all of the gaps together. Like ParallelEditScript, this blocks until
+done, so it must not be called from one of the pool's own workers.
+*/
+template <typename T, typename Predicate>
+Diff AnchoredDiff(ThreadPool& pool, const T old_sequence[], int N, const T new_sequence[], int M, Predicate is_anchor,
+                  const Options& options = Options()) {
+    MemoryBudget own;
+    MemoryBudgetScope scope(JoinMemoryBudget(own, options.memory_limit));
+    struct Occurrences {
+        int old_count = 0;
+        int old_pos = 0;
+        int new_count = 0;
+        int new_pos = 0;
+    };
+    typedef std::unordered_map<T, Occurrences, ElementHash<T>, ElementEqual<T>, CountingAllocator<std::pair<const T, Occurrences>, kStagePrepass>> Candidates;
+    Candidates candidates;
+    for (int i = 0; i < N; i++) {
+        if (is_anchor(old_sequence[i])) {
+            Occurrences& o = candidates[old_sequence[i]];
+            o.old_count++;
+            o.old_pos = i;
+        }
+    }
+    for (int j = 0; j < M; j++) {
+        typename Candidates::iterator it = candidates.find(new_sequence[j]);
+        if (it != candidates.end()) {
+            it->second.new_count++;
+            it->second.new_pos = j;
+        }
+    }
+    PrepassVector<std::pair<int, int>> anchors;
+    for (const auto& candidate : candidates) {
+        if (candidate.second.old_count == 1 && candidate.second.new_count == 1) {
+            anchors.push_back(std::make_pair(candidate.second.old_pos, candidate.second.new_pos));
+        }
+    }
+    std::sort(anchors.begin(), anchors.end());
+    for (size_t a = 1; a < anchors.size(); a++) {
+        if (anchors[a].second < anchors[a - 1].second) {
+            std::ostringstream message;
+            message << "anchors out of order: old " << anchors[a - 1].first << " before old " << anchors[a].first << ", but new "
+                    << anchors[a - 1].second << " after new " << anchors[a].second;
+            throw std::invalid_argument(message.str());
+        }
+    }
+
+    // The gaps before, between and after the anchors, each diffed on its own
+    anchors.push_back(std::make_pair(N, M));
+    std::vector<DiffGap> gaps;
+    int x = 0, y = 0;
+    for (const std::pair<int, int>& anchor : anchors) {
+        gaps.push_back(DiffGap{ x, y, anchor.first - x, anchor.second - y });
+        x = anchor.first + 1;
+        y = anchor.second + 1;
+    }
+    return DiffGaps(&pool, old_sequence, new_sequence, gaps, options);
+}
+
+// AnchoredDiff with the anchors given as a set of elements
+template <typename T>
+Diff AnchoredDiff(ThreadPool& pool, const T old_sequence[], int N, const T new_sequence[], int M, const std::vector<T>& anchors,
+                  const Options& options = Options()) {
+    std::unordered_set<T, ElementHash<T>, ElementEqual<T>> set(anchors.begin(), anchors.end());
+    return AnchoredDiff(pool, old_sequence, N, new_sequence, M, [&set](const T& element) { return set.count(element) > 0; }, options);
+}
+
+// One instruction of a copy/insert delta: new bytes [new_pos, new_pos + length) are either a copy ('c') of old
+// bytes [old_pos, old_pos + length) or the same bytes of the new input, inserted literally ('i', old_pos unused)
+struct DeltaOp {
+    char op;
+    int old_pos;
+    int new_pos;
+    int length;
+};
+
+// 'length' equal bytes at old input offset x and new input offset y
+struct BlockMatch {
+    int x, y, length;
+};
+
+/*
+Finds the large matches between two byte inputs cheaply, in the style of rsync and xdelta: the old input is
+indexed by a Rabin-Karp rolling hash of each aligned 'block'-byte block, and the new input is scanned for
+windows with the same hash, which are checked and then extended in both directions. The scan is split into
+regions of the new input that run concurrently on 'pool'. The matches are returned in new-input order and do
+not overlap in the new input; they may in the old one.
+
+Throws std::invalid_argument if 'block' is not positive. Like ParallelEditScript, this blocks until done, so
+it must not be called from one of the pool's own workers.
+*/
+std::vector<BlockMatch> FindBlockMatches(ThreadPool& pool, const unsigned char old_sequence[], int N, const unsigned char new_sequence[], int M,
+                                         int block) {
+    if (block <= 0) {
+        throw std::invalid_argument("block size must be positive");
+    }
+    const uint64_t kBase = 0x100000001B3ull;
+    uint64_t top = 1;
+    for (int i = 1; i < block; i++) {
+        top *= kBase;
+    }
+    auto hash_of = [&](const unsigned char* data) {
+        uint64_t hash = 0;
+        for (int i = 0; i < block; i++) {
+            hash = hash * kBase + data[i];
+        }
+        return hash;
+    };
+
+    // The first block of the old input with each hash
+    typedef std::unordered_map<uint64_t, int, std::hash<uint64_t>, std::equal_to<uint64_t>, CountingAllocator<std::pair<const uint64_t, int>, kStagePrepass>> Index;
+    Index index;
+    for (int x = 0; x + block <= N; x += block) {
+        index.emplace(hash_of(old_sequence + x), x);
+    }
+
+    // Scan regions of the new input for windows that hash like an old block; each region keeps its matches
+    int regions = M < (1 << 20) ? 1 : std::max(1, int(std::thread::hardware_concurrency()));
+    std::vector<std::vector<BlockMatch>> found(regions);
+    std::vector<std::future<void>> scanned;
+    for (int r = 0; r < regions && N >= block; r++) {
+        scanned.push_back(pool.Submit([&, r]() {
+            int first = int(int64_t(M) * r / regions), last = int(int64_t(M) * (r + 1) / regions);
+            int floor = first;
+            int y = first;
+            uint64_t hash = y + block <= M ? hash_of(new_sequence + y) : 0;
+            while (y < last && y + block <= M) {
+                Index::const_iterator it = index.find(hash);
+                if (it != index.end() && std::memcmp(old_sequence + it->second, new_sequence + y, block) == 0) {
+                    int x = it->second;
+                    int before = 0;
+                    while (x - before > 0 && y - before > floor && old_sequence[x - before - 1] == new_sequence[y - before - 1]) {
+                        before++;
+                    }
+                    int after = block + CommonPrefix(old_sequence + x + block, new_sequence + y + block, std::min(N - x, M - y) - block);
+                    found[r].push_back(BlockMatch{ x - before, y - before, before + after });
+                    y += after;
+                    floor = y;
+                    if (y + block <= M) {
+                        hash = hash_of(new_sequence + y);
+                    }
+                    continue;
+                }
+                if (y + block < M) {
+                    hash = (hash - new_sequence[y] * top) * kBase + new_sequence[y + block];
+                }
+                y++;
+            }
+        }));
+    }
+    WaitAll(scanned);
+
+    // A match may run into the next region; drop what the next region found inside it
+    std::vector<BlockMatch> matches;
+    for (const std::vector<BlockMatch>& region : found) {
+        for (BlockMatch m : region) {
+            int covered = matches.empty() ? 0 : matches.back().y + matches.back().length;
+            if (m.y < covered) {
+                int skip = covered - m.y;
+                if (skip >= m.length) {
+                    continue;
+                }
+                m.x += skip;
+                m.y += skip;
+                m.length -= skip;
+            }
+            matches.push_back(m);
+        }
+    }
+
+    return matches;
+}
+
+/*
+The copy/insert delta that rebuilds the new input from the old one: copies from anywhere in the old input,
+found by FindBlockMatches, in new-input order, with inserts for the bytes between them. This is only the
+match search, so it is linear in the inputs however little they have in common.
+*/
+std::vector<DeltaOp> BlockMatchDelta(ThreadPool& pool, const unsigned char old_sequence[], int N, const unsigned char new_sequence[], int M,
+                                     int block = 64) {
+    std::vector<DeltaOp> delta;
+    int y = 0;
+    for (const BlockMatch& m : FindBlockMatches(pool, old_sequence, N, new_sequence, M, block)) {
+        if (m.y > y) {
+            delta.push_back(DeltaOp{ 'i', 0, y, m.y - y });
+        }
+        delta.push_back(DeltaOp{ 'c', m.x, m.y, m.length });
+        y = m.y + m.length;
+    }
+    if (y < M) {
+        delta.push_back(DeltaOp{ 'i', 0, y, M - y });
+    }
+    return delta;
+}
+
+/*
+A byte diff for large binary inputs. Myers on bytes is quadratic in the amount of shifted content, so this
+first finds the large matches with FindBlockMatches. An edit script cannot cross itself, so the heaviest chain
+of matches in the same order in both inputs is kept, and only the gaps between them are diffed byte by byte
+with DiffSequences, also on 'pool'. A gap of more than 'max_gap' bytes in all is replaced outright instead
+(see DiffGaps). The script is therefore valid but only minimal within each gap that was searched.
+Options::memory_limit bounds the block index and all of the gaps together.
+
+Like ParallelEditScript, this blocks until done, so it must not be called from one of the pool's own workers.
+*/
+Diff BlockMatchDiff(ThreadPool& pool, const unsigned char old_sequence[], int N, const unsigned char new_sequence[], int M,
+                    int block = 64, const Options& options = Options(), int max_gap = 1 << 13) {
+    MemoryBudget own;
+    MemoryBudgetScope scope(JoinMemoryBudget(own, options.memory_limit));
+    std::vector<BlockMatch> matches = FindBlockMatches(pool, old_sequence, N, new_sequence, M, block);
+
+    // The heaviest chain of matches increasing in both inputs: matches are in new-input order, so a Fenwick
+    // tree over where they end in the old input gives the best chain each one can extend
+    std::vector<int> ends;
+    for (const BlockMatch& m : matches) {
+        ends.push_back(m.x + m.length);
+    }
+    std::sort(ends.begin(), ends.end());
+    ends.erase(std::unique(ends.begin(), ends.end()), ends.end());
+    std::vector<std::pair<long long, int>> tree(ends.size() + 1, std::make_pair(0LL, -1));
+    std::vector<long long> weight(matches.size());
+    std::vector<int> previous(matches.size());
+    std::pair<long long, int> best(0, -1);
+    for (int i = 0; i < int(matches.size()); i++) {
+        std::pair<long long, int> chain(0, -1);
+        // Chains ending at or before matches[i].x in the old input
+        for (int t = int(std::upper_bound(ends.begin(), ends.end(), matches[i].x) - ends.begin()); t > 0; t -= t & -t) {
+            chain = std::max(chain, tree[t]);
+        }
+        weight[i] = chain.first + matches[i].length;
+        previous[i] = chain.second;
+        std::pair<long long, int> entry(weight[i], i);
+        for (int t = int(std::lower_bound(ends.begin(), ends.end(), matches[i].x + matches[i].length) - ends.begin()) + 1; t <= int(ends.size()); t += t & -t) {
+            tree[t] = std::max(tree[t], entry);
+        }
+        best = std::max(best, entry);
+    }
+    std::vector<BlockMatch> chain;
+    for (int i = best.second; i >= 0; i = previous[i]) {
+        chain.push_back(matches[i]);
+    }
+    std::reverse(chain.begin(), chain.end());
+    chain.push_back(BlockMatch{ N, M, 0 });
+
+    // Refine the gaps between the kept matches
+    std::vector<DiffGap> gaps;
+    int x = 0, y = 0;
+    for (const BlockMatch& m : chain) {
+        gaps.push_back(DiffGap{ x, y, m.x - x, m.y - y });
+        x = m.x + m.length;
+        y = m.y + m.length;
+    }
+    return DiffGaps(&pool, old_sequence, new_sequence, gaps, options, max_gap);
+}
+
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_jthread)
+/*
+The awaitable returned by AsyncDiff. Awaiting it hands the diff to a ThreadPool and suspends the coroutine
+until the diff is done, so an event loop thread is never blocked by ShortestEditScript.
+*/
+class DiffAwaitable {
+public:
+    DiffAwaitable(ThreadPool& pool, const int old_sequence[], int N, const int new_sequence[], int M, const Options& options,
+                  std::stop_token stop, std::function<void(std::coroutine_handle<>)> resume)
+        : pool_(pool), old_sequence_(old_sequence), N_(N), new_sequence_(new_sequence), M_(M), options_(options),
+          stop_(std::move(stop)), resume_(std::move(resume)) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        pool_.Submit([this, handle]() {
+            std::atomic<bool> cancelled(false);
+            std::stop_callback on_stop(stop_, [&cancelled]() { cancelled = true; });
+            DiffWorkspace& workspace = ThreadWorkspace();
+            const std::atomic<bool>* outer = workspace.cancel;
+            workspace.cancel = &cancelled;
+            try {
+                if (cancelled) {
+                    throw DiffCancelled();
+                }
+                result_ = DiffSequences(old_sequence_, N_, new_sequence_, M_, options_);
+            }
+            catch (...) {
+                error_ = std::current_exception();
+            }
+            workspace.cancel = outer;
+            // The coroutine may read the allocation counts as soon as it resumes
+            ThreadAllocations().Merge();
+            // The coroutine may destroy this awaitable as soon as it resumes, so nothing of it is used afterwards
+            std::function<void(std::coroutine_handle<>)> resume = std::move(resume_);
+            if (resume) {
+                resume(handle);
+            }
+            else {
+                handle.resume();
+            }
+        });
+    }
+
+    // Throws DiffCancelled if the stop token was triggered before the diff finished
+    Diff await_resume() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return std::move(result_);
+    }
+
+private:
+    ThreadPool& pool_;
+    const int* old_sequence_;
+    int N_;
+    const int* new_sequence_;
+    int M_;
+    Options options_;
+    std::stop_token stop_;
+    std::function<void(std::coroutine_handle<>)> resume_;
+    Diff result_;
+    std::exception_ptr error_;
+};
+
+/*
+DiffSequences for C++20 coroutines:
+
+    Diff diff = co_await AsyncDiff(pool, old_sequence, N, new_sequence, M, options, stop_token, post);
+
+The sequences must stay alive until the co_await completes. A stop request makes the diff give up at its next
+subdivision and co_await throw DiffCancelled. The coroutine is resumed by calling 'resume' with its handle,
+where an event loop passes a function that posts the handle to its own thread; without one the coroutine
+simply continues on the pool worker that ran the diff.
+*/
+DiffAwaitable AsyncDiff(ThreadPool& pool, const int old_sequence[], int N, const int new_sequence[], int M, const Options& options = Options(),
+                        std::stop_token stop = std::stop_token(), std::function<void(std::coroutine_handle<>)> resume = nullptr) {
+    return DiffAwaitable(pool, old_sequence, N, new_sequence, M, options, std::move(stop), std::move(resume));
+}
+
+/*
+LazyEditScript for C++20 coroutines, an async generator of hunks. Each co_await computes the next batch of
+up to 'batch' hunks on a ThreadPool worker, so a large diff hands over its first hunks long before the rest
+of the script is known:
+
+    AsyncEditScript script(pool, old_sequence, N, new_sequence, M, stop_token, post);
+    for (std::vector<LazyEditScript::Hunk> hunks; !(hunks = co_await script.Next()).empty();) {
+        ...
+    }
+
+An empty batch means the script is finished. The sequences must outlive the script, and only one Next may be
+awaited at a time. Stop requests and resuming work as for AsyncDiff; a cancelled Next throws DiffCancelled.
+*/
+class AsyncEditScript {
+public:
+    AsyncEditScript(ThreadPool& pool, const int old_sequence[], int N, const int new_sequence[], int M,
+                    std::stop_token stop = std::stop_token(), std::function<void(std::coroutine_handle<>)> resume = nullptr,
+                    size_t batch = 64)
+        : pool_(pool), script_(old_sequence, N, new_sequence, M), stop_(std::move(stop)), resume_(std::move(resume)),
+          batch_(std::max<size_t>(batch, 1)) {}
+
+    class NextAwaitable {
+    public:
+        explicit NextAwaitable(AsyncEditScript& script) : script_(script) {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            script_.pool_.Submit([this, handle]() {
+                std::atomic<bool> cancelled(false);
+                std::stop_callback on_stop(script_.stop_, [&cancelled]() { cancelled = true; });
+                DiffWorkspace& workspace = ThreadWorkspace();
+                const std::atomic<bool>* outer = workspace.cancel;
+                workspace.cancel = &cancelled;
+                try {
+                    if (cancelled) {
+                        throw DiffCancelled();
+                    }
+                    LazyEditScript::Hunk hunk;
+                    while (hunks_.size() < script_.batch_ && script_.script_.Next(hunk)) {
+                        hunks_.push_back(hunk);
+                    }
+                }
+                catch (...) {
+                    error_ = std::current_exception();
+                }
+                workspace.cancel = outer;
+                ThreadAllocations().Merge();
+                // As in DiffAwaitable, nothing of this awaitable is touched once the coroutine may resume
+                std::function<void(std::coroutine_handle<>)> resume = script_.resume_;
+                if (resume) {
+                    resume(handle);
+                }
+                else {
+                    handle.resume();
+                }
+            });
+        }
+
+        std::vector<LazyEditScript::Hunk> await_resume() {
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+            return std::move(hunks_);
+        }
+
+    private:
+        AsyncEditScript& script_;
+        std::vector<LazyEditScript::Hunk> hunks_;
+        std::exception_ptr error_;
+    };
+
+    // The next batch of hunks, empty once the script is finished
+    NextAwaitable Next() {
+        return NextAwaitable(*this);
+    }
+
+private:
+    ThreadPool& pool_;
+    LazyEditScript script_;
+    std::stop_token stop_;
+    std::function<void(std::coroutine_handle<>)> resume_;
+    size_t batch_;
+};
+#endif
+
+/*
+A regular expression for LineMask, matched without backtracking. std::regex matches by recursion, one level
+per character on many patterns, so a long enough line overflows the stack; here the pattern is compiled to
+a Thompson NFA. Replace runs it over the line three times: forward, to find which instructions can be
+entered where; backward, to work out where the first-ranked match from each of those ends; and forward again
+to pick the matches. That takes time linear in the length of the line times the size of the compiled
+pattern, however many matches there are and however far a failed attempt reads ahead, and stack space that
+depends on neither; patterns with little alive at a time, as masks mostly are, cost much less.
+
+The syntax is the ECMAScript subset that masks need: literals and escapes, '.', classes such as [0-9a-f] and
+[^,], \d \w \s and their negations, groups (capturing or not), alternation, the quantifiers * + ? {n} {n,}
+{n,m} and their lazy forms, and the assertions ^ $ \b \B. A match is the one std::regex would report.
+Backreferences and lookaround need backtracking and are refused, and so are unbounded repeats of something
+that can match nothing, such as (a*)*, on which backtracking matchers disagree; so is anything unsupported.
+*/
+class MaskPattern {
+public:
+    // Throws std::invalid_argument naming the problem when 'pattern' is invalid or uses an unsupported feature
+    explicit MaskPattern(const std::string& pattern) : pattern_(pattern), at_(0) {
+        Node root = ParseAlternation();
+        if (at_ < pattern_.size()) {
+            Fail("unmatched )");
+        }
+        Emit(root);
+        program_.push_back(Instruction{ kMatch, 0, 0 });
+        for (int pc = 0; pc < int(program_.size()); pc++) {
+            if (program_[pc].op == kSet) {
+                for (int c = 0; c < 256; c++) {
+                    if (sets_[program_[pc].x].test(c)) {
+                        entries_[c].push_back(pc + 1);
+                    }
+                }
+            }
+        }
+    }
+
+    const std::string& Source() const {
+        return pattern_;
+    }
+
+    /*
+    Replaces every match in 'text' with 'replacement', resuming after each, as std::regex_replace does: after
+    an empty match a non-empty one may still start at the same place, and failing that the next character is
+    kept. Unlike there, ^ and \b still see the character before that place.
+    */
+    std::string Replace(const std::string& text, const std::string& replacement) const {
+        Scratch& scratch = ThreadScratch();
+        FindMatchEnds(text, scratch);
+        std::string replaced;
+        int size = int(text.size()), pos = 0;
+        bool after_empty = false;
+        for (int start = 0; start <= size;) {
+            int end = after_empty ? scratch.non_empty_ends[start] : scratch.ends[start];
+            after_empty = false;
+            if (end < 0) {
+                start++;
+                continue;
+            }
+            replaced.append(text, pos, start - pos);
+            replaced += replacement;
+            after_empty = end == start;
+            pos = start = end;
+        }
+        if (pos < size) {
+            replaced.append(text, pos, std::string::npos);
+        }
+        return replaced;
+    }
+
+private:
+    enum Op {
+        // Consume a character in sets_[x]
+        kSet,
+        // Continue at x, then (at a lower rank) at y
+        kSplit,
+        kJump,
+        // Continue only where assertion x ('^', '$', 'b' or 'B') holds
+        kAssert,
+        kMatch
+    };
+
+    struct Instruction {
+        Op op;
+        int x, y;
+    };
+
+    // Reused from line to line, so that masking allocates nothing once the buffers have grown
+    struct Scratch {
+        // Where the first-ranked match starting at each position ends, -1 for none; also for non-empty matches
+        std::vector<int> ends, non_empty_ends;
+        // Where the first-ranked match from each instruction ends, at the current position and the next
+        std::vector<int> row, next_row, non_empty_row;
+        // The pass an instruction was last resolved in; every position gets one pass, and another for non-empty matches
+        std::vector<unsigned> resolved;
+        unsigned pass = 0;
+        // The instructions being resolved, each with how far it got
+        std::vector<std::pair<int, int>> stack;
+        // The instructions entered at each position pos after the start, roots[root_begin[pos], root_begin[pos + 1])
+        std::vector<int> roots, root_begin, live;
+    };
+
+    // Past this many entered instructions over a line, every instruction after a matching set counts as entered
+    static const size_t kMaxRoots = size_t(1) << 22;
+
+    // The parsed pattern
+    struct Node {
+        enum Kind { kSet, kConcat, kAlternate, kRepeat, kAssert } kind;
+        // The set for kSet, the assertion for kAssert, the bounds for kRepeat (max -1 for none)
+        int value = 0, min = 0, max = 0;
+        bool greedy = true;
+        std::vector<Node> children;
+    };
+
+    static const int kMaxRepeat = 1000;
+    static const size_t kMaxProgram = 20000;
+
+    [[noreturn]] void Fail(const std::string& problem) const {
+        throw std::invalid_argument(problem + " at offset " + std::to_string(at_));
+    }
+
+    bool More() const {
+        return at_ < pattern_.size();
+    }
+
+    Node ParseAlternation() {
+        Node branch = ParseConcatenation();
+        if (!More() || pattern_[at_] != '|') {
+            return branch;
+        }
+        Node alternation;
+        alternation.kind = Node::kAlternate;
+        alternation.children.push_back(std::move(branch));
+        while (More() && pattern_[at_] == '|') {
+            at_++;
+            alternation.children.push_back(ParseConcatenation());
+        }
+        return alternation;
+    }
+
+    Node ParseConcatenation() {
+        Node concatenation;
+        concatenation.kind = Node::kConcat;
+        while (More() && pattern_[at_] != '|' && pattern_[at_] != ')') {
+            concatenation.children.push_back(ParseRepeat());
+        }
+        return concatenation;
+    }
+
+    Node ParseRepeat() {
+        Node atom = ParseAtom();
+        int min, max;
+        if (!ParseQuantifier(min, max)) {
+            return atom;
+        }
+        if (atom.kind == Node::kAssert) {
+            Fail("nothing to repeat");
+        }
+        Node repeat;
+        repeat.kind = Node::kRepeat;
+        repeat.min = min;
+        repeat.max = max;
+        if (More() && pattern_[at_] == '?') {
+            repeat.greedy = false;
+            at_++;
+        }
+        if (max < 0 && Nullable(atom)) {
+            // Each pass could match nothing; backtracking matchers stop such loops in ways that disagree
+            Fail("unbounded repeat of something that can match nothing");
+        }
+        repeat.children.push_back(std::move(atom));
+        int dummy_min, dummy_max;
+        if (ParseQuantifier(dummy_min, dummy_max)) {
+            Fail("nothing to repeat");
+        }
+        return repeat;
+    }
+
+    static bool Nullable(const Node& node) {
+        switch (node.kind) {
+        case Node::kSet:
+            return false;
+        case Node::kConcat:
+            return std::all_of(node.children.begin(), node.children.end(), Nullable);
+        case Node::kAlternate:
+            return std::any_of(node.children.begin(), node.children.end(), Nullable);
+        case Node::kRepeat:
+            return node.min == 0 || Nullable(node.children[0]);
+        default:
+            return true;
+        }
+    }
+
+    // Reads a quantifier, if one is next; '{' that does not start a valid one is a literal, as in browsers
+    bool ParseQuantifier(int& min, int& max) {
+        if (!More()) {
+            return false;
+        }
+        char c = pattern_[at_];
+        if (c == '*' || c == '+' || c == '?') {
+            at_++;
+            min = c == '+' ? 1 : 0;
+            max = c == '?' ? 1 : -1;
+            return true;
+        }
+        if (c != '{') {
+            return false;
+        }
+        size_t pos = at_ + 1;
+        auto number = [&](int& value) {
+            size_t first = pos;
+            long long n = 0;
+            while (pos < pattern_.size() && std::isdigit((unsigned char)pattern_[pos])) {
+                n = std::min<long long>(n * 10 + (pattern_[pos++] - '0'), kMaxRepeat + 1);
+            }
+            value = int(n);
+            return pos > first;
+        };
+        if (!number(min)) {
+            return false;
+        }
+        max = min;
+        if (pos < pattern_.size() && pattern_[pos] == ',') {
+            pos++;
+            if (!number(max)) {
+                max = -1;
+            }
+        }
+        if (pos >= pattern_.size() || pattern_[pos] != '}') {
+            return false;
+        }
+        at_ = pos + 1;
+        if (min > kMaxRepeat || max > kMaxRepeat) {
+            Fail("repeat count above " + std::to_string(kMaxRepeat));
+        }
+        if (max >= 0 && max < min) {
+            Fail("repeat counts out of order");
+        }
+        return true;
+    }
+
+    Node ParseAtom() {
+        Node atom;
+        char c = pattern_[at_++];
+        switch (c) {
+        case '(':
+            if (More() && pattern_[at_] == '?') {
+                if (at_ + 1 < pattern_.size() && pattern_[at_ + 1] == ':') {
+                    at_ += 2;
+                }
+                else {
+                    Fail("lookaround is not supported");
+                }
+            }
+            atom = ParseAlternation();
+            if (!More() || pattern_[at_] != ')') {
+                Fail("missing )");
+            }
+            at_++;
+            return atom;
+        case '[':
+            return SetNode(ParseClass());
+        case '.': {
+            std::bitset<256> any;
+            any.set();
+            any.reset('\n');
+            any.reset('\r');
+            return SetNode(any);
+        }
+        case '^':
+        case '$':
+            atom.kind = Node::kAssert;
+            atom.value = c;
+            return atom;
+        case '*':
+        case '+':
+        case '?':
+            at_--;
+            Fail("nothing to repeat");
+        case '\\': {
+            if (!More()) {
+                Fail("trailing \\");
+            }
+            char e = pattern_[at_];
+            if (e == 'b' || e == 'B') {
+                at_++;
+                atom.kind = Node::kAssert;
+                atom.value = e;
+                return atom;
+            }
+            std::bitset<256> set;
+            ParseEscape(set, false);
+            return SetNode(set);
+        }
+        default: {
+            std::bitset<256> set;
+            set.set((unsigned char)c);
+            return SetNode(set);
+        }
+        }
+    }
+
+    // Reads an escape after the '\', adding what it stands for to 'set'
+    void ParseEscape(std::bitset<256>& set, bool in_class) {
+        char e = pattern_[at_++];
+        std::bitset<256> named;
+        switch (e) {
+        case 'd':
+        case 'D':
+            for (int c = '0'; c <= '9'; c++) named.set(c);
+            break;
+        case 'w':
+        case 'W':
+            for (int c = 0; c < 256; c++) named[c] = std::isalnum(c) && c < 128;
+            named.set('_');
+            break;
+        case 's':
+        case 'S':
+            for (char c : std::string(" \t\n\r\f\v")) named.set((unsigned char)c);
+            break;
+        case 't': set.set('\t'); return;
+        case 'n': set.set('\n'); return;
+        case 'r': set.set('\r'); return;
+        case 'f': set.set('\f'); return;
+        case 'v': set.set('\v'); return;
+        case '0': set.set(0); return;
+        case 'b':
+            // Only reached inside a class, where it is a backspace
+            set.set('\b');
+            return;
+        case 'x':
+            if (at_ + 2 <= pattern_.size() && std::isxdigit((unsigned char)pattern_[at_]) && std::isxdigit((unsigned char)pattern_[at_ + 1])) {
+                set.set(std::stoi(pattern_.substr(at_, 2), nullptr, 16));
+                at_ += 2;
+                return;
+            }
+            set.set('x');
+            return;
+        default:
+            if (e >= '1' && e <= '9' && !in_class) {
+                at_--;
+                Fail("backreferences are not supported");
+            }
+            if (std::isalnum((unsigned char)e)) {
+                at_--;
+                Fail("unsupported escape");
+            }
+            set.set((unsigned char)e);
+            return;
+        }
+        set |= std::isupper((unsigned char)e) ? ~named : named;
+    }
+
+    // Reads a class after the '['
+    std::bitset<256> ParseClass() {
+        std::bitset<256> set;
+        bool negated = More() && pattern_[at_] == '^';
+        if (negated) {
+            at_++;
+        }
+        while (More() && pattern_[at_] != ']') {
+            std::bitset<256> item;
+            int low = -1;
+            if (pattern_[at_] == '\\' && at_ + 1 < pattern_.size()) {
+                at_++;
+                ParseEscape(item, true);
+                low = item.count() == 1 ? int(FirstOf(item)) : -1;
+            }
+            else {
+                low = (unsigned char)pattern_[at_++];
+                item.set(low);
+            }
+            // A range, unless the '-' is last in the class
+            if (low >= 0 && at_ + 1 < pattern_.size() && pattern_[at_] == '-' && pattern_[at_ + 1] != ']') {
+                at_++;
+                std::bitset<256> upper;
+                if (pattern_[at_] == '\\' && at_ + 1 < pattern_.size()) {
+                    at_++;
+                    ParseEscape(upper, true);
+                }
+                else {
+                    upper.set((unsigned char)pattern_[at_++]);
+                }
+                if (upper.count() != 1) {
+                    Fail("bad class range");
+                }
+                int high = int(FirstOf(upper));
+                if (high < low) {
+                    Fail("class range out of order");
+                }
+                for (int c = low; c <= high; c++) {
+                    item.set(c);
+                }
+            }
+            set |= item;
+        }
+        if (!More()) {
+            Fail("missing ]");
+        }
+        at_++;
+        return negated ? ~set : set;
+    }
+
+    static size_t FirstOf(const std::bitset<256>& set) {
+        size_t c = 0;
+        while (!set.test(c)) c++;
+        return c;
+    }
+
+    Node SetNode(const std::bitset<256>& set) {
+        Node node;
+        node.kind = Node::kSet;
+        node.value = int(sets_.size());
+        sets_.push_back(set);
+        return node;
+    }
+
+    int Append(Op op, int x = 0, int y = 0) {
+        if (program_.size() >= kMaxProgram) {
+            Fail("pattern too large");
+        }
+        program_.push_back(Instruction{ op, x, y });
+        return int(program_.size()) - 1;
+    }
+
+    // A split that prefers 'first' when greedy, and the other way around when lazy
+    void SetSplit(int at, int first, int second, bool greedy) {
+        program_[at].x = greedy ? first : second;
+        program_[at].y = greedy ? second : first;
+    }
+
+    void Emit(const Node& node) {
+        switch (node.kind) {
+        case Node::kSet:
+            Append(kSet, node.value);
+            break;
+        case Node::kAssert:
+            Append(kAssert, node.value);
+            break;
+        case Node::kConcat:
+            for (const Node& child : node.children) {
+                Emit(child);
+            }
+            break;
+        case Node::kAlternate: {
+            std::vector<int> jumps;
+            for (size_t i = 0; i + 1 < node.children.size(); i++) {
+                int split = Append(kSplit);
+                Emit(node.children[i]);
+                jumps.push_back(Append(kJump));
+                SetSplit(split, split + 1, int(program_.size()), true);
+            }
+            Emit(node.children.back());
+            for (int jump : jumps) {
+                program_[jump].x = int(program_.size());
+            }
+            break;
+        }
+        case Node::kRepeat: {
+            const Node& body = node.children[0];
+            for (int i = 0; i < node.min; i++) {
+                Emit(body);
+            }
+            if (node.max < 0) {
+                int split = Append(kSplit);
+                Emit(body);
+                Append(kJump, split);
+                SetSplit(split, split + 1, int(program_.size()), node.greedy);
+                break;
+            }
+            std::vector<int> splits;
+            for (int i = node.min; i < node.max; i++) {
+                splits.push_back(Append(kSplit));
+                Emit(body);
+            }
+            for (int split : splits) {
+                SetSplit(split, split + 1, int(program_.size()), node.greedy);
+            }
+            break;
+        }
+        }
+    }
+
+    static bool IsWord(const std::string& text, size_t pos) {
+        return pos < text.size() && (std::isalnum((unsigned char)text[pos]) || text[pos] == '_') && (unsigned char)text[pos] < 128;
+    }
+
+    static Scratch& ThreadScratch() {
+        thread_local Scratch scratch;
+        return scratch;
+    }
+
+    bool Holds(int assertion, const std::string& text, int pos) const {
+        bool boundary = IsWord(text, pos) != (pos > 0 && IsWord(text, pos - 1));
+        return assertion == '^' ? pos == 0
+             : assertion == '$' ? pos == int(text.size())
+             : assertion == 'b' ? boundary : !boundary;
+    }
+
+    // Fills scratch.ends and, where the first-ranked match is empty, scratch.non_empty_ends
+    void FindMatchEnds(const std::string& text, Scratch& scratch) const {
+        int size = int(text.size());
+        scratch.ends.assign(size + 1, -1);
+        scratch.non_empty_ends.assign(size + 1, -1);
+        scratch.row.assign(program_.size(), -1);
+        scratch.next_row.assign(program_.size(), -1);
+        scratch.non_empty_row.assign(program_.size(), -1);
+        scratch.resolved.assign(program_.size(), 0);
+        scratch.pass = 0;
+        bool reached = FindRoots(text, scratch);
+        for (int pos = size; pos >= 0; pos--) {
+            // Only the start, and the instructions after a set that takes the character before, are entered here
+            scratch.pass++;
+            Resolve(0, text, pos, false, scratch.row, scratch);
+            if (reached) {
+                for (int i = scratch.root_begin[pos]; i < scratch.root_begin[pos + 1]; i++) {
+                    Resolve(scratch.roots[i], text, pos, false, scratch.row, scratch);
+                }
+            }
+            else if (pos > 0) {
+                for (int pc : entries_[(unsigned char)text[pos - 1]]) {
+                    Resolve(pc, text, pos, false, scratch.row, scratch);
+                }
+            }
+            scratch.ends[pos] = scratch.row[0];
+            if (scratch.row[0] == pos) {
+                scratch.pass++;
+                Resolve(0, text, pos, true, scratch.non_empty_row, scratch);
+                scratch.non_empty_ends[pos] = scratch.non_empty_row[0];
+            }
+            scratch.row.swap(scratch.next_row);
+        }
+    }
+
+    /*
+    Fills scratch.roots with the instructions a match that started anywhere can be at after each character, by
+    running every thread forward, in no particular rank. Then FindMatchEnds only resolves instructions that can
+    matter, so a large pattern costs little where little of it is alive.
+
+    @return  false, leaving scratch.roots unusable, when they would take more than kMaxRoots entries
+    */
+    bool FindRoots(const std::string& text, Scratch& scratch) const {
+        int size = int(text.size());
+        scratch.roots.clear();
+        scratch.root_begin.assign(size + 2, 0);
+        for (int pos = 0; pos < size; pos++) {
+            // The sets alive at pos, reached from the start and from what was entered here
+            scratch.pass++;
+            scratch.live.clear();
+            scratch.stack.assign(1, std::make_pair(0, 0));
+            for (int i = scratch.root_begin[pos]; i < scratch.root_begin[pos + 1]; i++) {
+                scratch.stack.push_back(std::make_pair(scratch.roots[i], 0));
+            }
+            while (!scratch.stack.empty()) {
+                int pc = scratch.stack.back().first;
+                scratch.stack.pop_back();
+                if (scratch.resolved[pc] == scratch.pass) {
+                    continue;
+                }
+                scratch.resolved[pc] = scratch.pass;
+                const Instruction& instruction = program_[pc];
+                switch (instruction.op) {
+                case kSet:
+                    scratch.live.push_back(pc);
+                    break;
+                case kSplit:
+                    scratch.stack.push_back(std::make_pair(instruction.y, 0));
+                    scratch.stack.push_back(std::make_pair(instruction.x, 0));
+                    break;
+                case kJump:
+                    scratch.stack.push_back(std::make_pair(instruction.x, 0));
+                    break;
+                case kAssert:
+                    if (Holds(instruction.x, text, pos)) {
+                        scratch.stack.push_back(std::make_pair(pc + 1, 0));
+                    }
+                    break;
+                case kMatch:
+                    break;
+                }
+            }
+            for (int pc : scratch.live) {
+                if (sets_[program_[pc].x].test((unsigned char)text[pos])) {
+                    scratch.roots.push_back(pc + 1);
+                }
+            }
+            if (scratch.roots.size() > kMaxRoots) {
+                return false;
+            }
+            scratch.root_begin[pos + 2] = int(scratch.roots.size());
+        }
+        return true;
+    }
+
+    /*
+    Sets row[root] to where the first-ranked match from instruction 'root' at 'pos' ends, -1 for none, given
+    scratch.next_row for pos + 1. Splits try x before y, as a backtracking matcher would. Without unbounded
+    repeats of what can match nothing, no instruction leads back to itself without consuming a character,
+    so every result is final once worked out.
+    */
+    void Resolve(int root, const std::string& text, int pos, bool non_empty, std::vector<int>& row, Scratch& scratch) const {
+        std::vector<std::pair<int, int>>& stack = scratch.stack;
+        stack.assign(1, std::make_pair(root, 0));
+        while (!stack.empty()) {
+            int pc = stack.back().first, step = stack.back().second;
+            const Instruction& instruction = program_[pc];
+            if (step == 0) {
+                if (scratch.resolved[pc] == scratch.pass) {
+                    stack.pop_back();
+                    continue;
+                }
+                scratch.resolved[pc] = scratch.pass;
+                row[pc] = -1;
+            }
+            int next = -1;
+            switch (instruction.op) {
+            case kSet:
+                if (pos < int(text.size()) && sets_[instruction.x].test((unsigned char)text[pos])) {
+                    row[pc] = scratch.next_row[pc + 1];
+                }
+                break;
+            case kMatch:
+                row[pc] = non_empty ? -1 : pos;
+                break;
+            case kAssert:
+                if (step == 0 && Holds(instruction.x, text, pos)) {
+                    next = pc + 1;
+                }
+                else if (step == 1) {
+                    row[pc] = row[pc + 1];
+                }
+                break;
+            case kJump:
+                if (step == 0) {
+                    next = instruction.x;
+                }
+                else {
+                    row[pc] = row[instruction.x];
+                }
+                break;
+            case kSplit:
+                if (step == 0) {
+                    next = instruction.x;
+                }
+                else if (step == 1 && row[instruction.x] < 0) {
+                    next = instruction.y;
+                }
+                else {
+                    row[pc] = row[step == 1 ? instruction.x : instruction.y];
+                }
+                break;
+            }
+            if (next >= 0) {
+                stack.back().second++;
+                stack.push_back(std::make_pair(next, 0));
+            }
+            else {
+                stack.pop_back();
+            }
+        }
+    }
+
+    std::string pattern_;
+    size_t at_;
+    std::vector<std::bitset<256>> sets_;
+    std::vector<Instruction> program_;
+    // For every byte, the instructions after each set that holds it
+    std::vector<int> entries_[256];
+};
+
+/*
+Rewrites the volatile parts of a line (timestamps, request ids, counters) to a fixed placeholder, so that two
+log lines that differ only there compare equal. LineInterner applies it to every new line it interns, so
+masked lines are interned to the same key and the diff only sees the real differences. Every mask runs in
+time linear in the length of the line, since lines with timestamps are nearly all distinct and can be long.
+
+Three kinds of masks are applied in this order:
+  - fields: whole fields, counted from 1, of lines split on 'separator' (any run of blanks by default)
+  - patterns: regular expressions (see MaskPattern), every match replaced
+  - numbers: every run of digits, and every word made only of hex digits that holds a digit (hashes, UUID
+    parts), found in one pass over the line without a regex
+*/
+class LineMask {
+public:
+    void AddField(int field) {
+        fields_.push_back(field);
+    }
+
+    // Throws std::invalid_argument when 'pattern' is not a valid regular expression
+    void AddPattern(const std::string& pattern) {
+        patterns_.emplace_back(pattern);
+    }
+
+    void SetSeparator(char separator) {
+        separator_ = separator;
+    }
+
+    void MaskNumbers(bool mask) {
+        numbers_ = mask;
+    }
+
+    bool Empty() const {
+        return fields_.empty() && patterns_.empty() && !numbers_;
+    }
+
+    // An FNV-1a hash of every option, in the order given, to tell apart results kept from other masks; 0 when Empty
+    uint64_t Fingerprint() const {
+        if (Empty()) {
+            return 0;
+        }
+        std::ostringstream options;
+        options << "fields";
+        for (int field : fields_) {
+            options << " " << field;
+        }
+        options << "\nseparator " << int(separator_) << "\nnumbers " << numbers_ << "\n";
+        for (const MaskPattern& pattern : patterns_) {
+            options << "pattern " << pattern.Source().size() << " " << pattern.Source() << "\n";
+        }
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : options.str()) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    std::string Apply(const std::string& line) const {
+        std::string masked = fields_.empty() ? line : MaskFields(line);
+        for (const MaskPattern& pattern : patterns_) {
+            masked = pattern.Replace(masked, kPlaceholder);
+        }
+        return numbers_ ? MaskNumberWords(masked) : masked;
+    }
+
+private:
+    static constexpr const char* kPlaceholder = "\x1f";
+
+    std::string MaskFields(const std::string& line) const {
+        std::string masked;
+        int field = 0;
+        for (size_t pos = 0; pos <= line.size();) {
+            // Keep the separators, so fields are still told apart after masking
+            size_t start = pos;
+            if (separator_ == 0) {
+                while (start < line.size() && (line[start] == ' ' || line[start] == '\t')) start++;
+            }
+            masked.append(line, pos, start - pos);
+            if (start == line.size() && separator_ == 0) {
+                break;
+            }
+            size_t end = start;
+            while (end < line.size() && (separator_ ? line[end] != separator_ : line[end] != ' ' && line[end] != '\t')) end++;
+            field++;
+            if (std::find(fields_.begin(), fields_.end(), field) != fields_.end()) {
+                masked += kPlaceholder;
+            }
+            else {
+                masked.append(line, start, end - start);
+            }
+            if (end < line.size() && separator_) {
+                masked += separator_;
+                end++;
+            }
+            else if (end == line.size()) {
+                break;
+            }
+            pos = end;
+        }
+        return masked;
+    }
+
+    static std::string MaskNumberWords(const std::string& line) {
+        std::string masked;
+        masked.reserve(line.size());
+        for (size_t i = 0; i < line.size();) {
+            if (!std::isalnum((unsigned char)line[i])) {
+                masked += line[i++];
+                continue;
+            }
+            size_t end = i;
+            bool hex = true, digit = false;
+            for (; end < line.size() && std::isalnum((unsigned char)line[end]); end++) {
+                hex = hex && std::isxdigit((unsigned char)line[end]);
+                digit = digit || std::isdigit((unsigned char)line[end]);
+            }
+            if (hex && digit) {
+                masked += kPlaceholder;
+            }
+            else {
+                // Only the digit runs inside a word ('T12', 'req42') change
+                for (size_t j = i; j < end;) {
+                    if (std::isdigit((unsigned char)line[j])) {
+                        while (j < end && std::isdigit((unsigned char)line[j])) j++;
+                        masked += kPlaceholder;
+                    }
+                    else {
+                        masked += line[j++];
+                    }
+                }
+            }
+            i = end;
+        }
+        return masked;
+    }
+
+    std::vector<int> fields_;
+    std::vector<MaskPattern> patterns_;
+    char separator_ = 0;
+    bool numbers_ = false;
+};
+
+/*
+Maps every distinct line of text to a small integer, so that files can be compared as arrays of integers.
+With a LineMask, every id also gets a key: the id of the first line that is the same after masking. Diffing
+the keys compares the masked lines, while the ids still give back each line as it was.
+*/
+class LineInterner {
+public:
+    // Masks the lines interned from now on; 'mask' must outlive the interner
+    void SetMask(const LineMask* mask) {
+        mask_ = mask && !mask->Empty() ? mask : nullptr;
+    }
+
+    int Intern(const std::string& line) {
+        std::unordered_map<std::string, int>::iterator it = ids_.find(line);
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        int id = int(lines_.size());
+        lines_.push_back(line);
+        if (mask_) {
+            keys_.push_back(masked_ids_.emplace(mask_->Apply(line), id).first->second);
+        }
+        return ids_[line] = id;
+    }
+
+    const std::string& Text(int id) const {
+        return lines_[id];
+    }
+
+    int Key(int id) const {
+        return id < int(keys_.size()) ? keys_[id] : id;
+    }
+
+    // The keys of 'ids', which are the ids themselves when nothing is masked
+    std::vector<int> Keys(const std::vector<int>& ids) const {
+        std::vector<int> keys(ids);
+        if (!keys_.empty()) {
+            for (int& id : keys) {
+                id = keys_[id];
+            }
+        }
+        return keys;
+    }
+
+private:
+    std::unordered_map<std::string, int> ids_;
+    std::vector<std::string> lines_;
+    const LineMask* mask_ = nullptr;
+    std::unordered_map<std::string, int> masked_ids_;
+    std::vector<int> keys_;
+};
+
+/*
+Splits 'size' bytes of text into lines and appends their ids to 'ids'. The text may end in the middle of a
+line, in which case the unfinished part is left in 'carry' and joined with the next call's data. Call it one
+last time with no data once the input is exhausted to flush what is left in 'carry'.
+*/
+void InternLines(const char* data, size_t size, std::string& carry, LineInterner& interner, std::vector<int>& ids) {
+    if (size == 0) {
+        if (!carry.empty()) {
+            ids.push_back(interner.Intern(carry));
+            carry.clear();
+        }
+        return;
+    }
+    const char* end = data + size;
+    for (const char* line = data; line < end;) {
+        const char* newline = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!newline) {
+            carry.append(line, end);
+            break;
+        }
+        carry.append(line, newline);
+        ids.push_back(interner.Intern(carry));
+        carry.clear();
+        line = newline + 1;
+    }
+}
+
+#ifdef MYERS_WITH_ZSTD
+/*
+Decompresses the zstd stream 'source' and hands the output to 'consume' in order, as it becomes available,
+so the caller can work on the start of the data (e.g. intern its lines) while the rest is still being
+decompressed. Memory stays bounded by a few frames, however large the input is.
+
+'pzstd' and 'zstd -T' write large inputs as many independent frames. Those frames are read one at a time and
+decompressed on a pool of threads, with at most two per thread in flight. A frame too large to hold
+(any single-frame file of some size, for one) switches to streaming the rest of the input through a
+ZstdInputBuffer on the calling thread instead. That needs 'source' to be seekable.
+
+@return  false on a corrupt input
+*/
+bool DecompressZstd(std::istream& source, const std::function<void(const char*, size_t)>& consume) {
+    const size_t kReadSize = 1 << 16, kMaxFrame = size_t(8) << 20;
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    ThreadPool pool(threads);
+    std::deque<std::future<std::string>> in_flight;
+    std::atomic<bool> ok(true);
+    auto deliver_oldest = [&]() {
+        std::string frame = in_flight.front().get();
+        in_flight.pop_front();
+        consume(frame.data(), frame.size());
+    };
+
+    std::string pending;
+    // Where 'pending' starts in 'source'
+    std::streamoff offset = source.tellg();
+    size_t wanted = kReadSize;
+    bool eof = false;
+    while (ok) {
+        while (pending.size() < wanted && !eof) {
+            size_t size = pending.size();
+            pending.resize(size + kReadSize);
+            source.read(&pending[size], std::streamsize(kReadSize));
+            pending.resize(size + size_t(source.gcount()));
+            eof = source.gcount() == 0;
+        }
+        if (pending.empty()) {
+            break;
+        }
+        size_t size = ZSTD_findFrameCompressedSize(pending.data(), pending.size());
+        if (!ZSTD_isError(size)) {
+            std::shared_ptr<std::string> frame = std::make_shared<std::string>(pending, 0, size);
+            in_flight.push_back(pool.Submit([frame, &ok]() {
+                std::string output;
+                ZSTD_DCtx* dctx = ZSTD_createDCtx();
+                ZSTD_inBuffer input = { frame->data(), frame->size(), 0 };
+                std::vector<char> buffer(ZSTD_DStreamOutSize());
+                for (;;) {
+                    ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+                    size_t status = ZSTD_decompressStream(dctx, &out, &input);
+                    output.append(buffer.data(), out.pos);
+                    if (status == 0) {
+                        break;
+                    }
+                    if (ZSTD_isError(status) || (input.pos == input.size && out.pos < out.size)) {
+                        ok = false;
+                        break;
+                    }
+                }
+                ZSTD_freeDCtx(dctx);
+                return output;
+            }));
+            pending.erase(0, size);
+            offset += std::streamoff(size);
+            wanted = kReadSize;
+            if (int(in_flight.size()) >= 2 * threads) {
+                deliver_oldest();
+            }
+        }
+        else if (eof) {
+            ok = false;
+        }
+        else if (pending.size() < kMaxFrame) {
+            // Read twice as far before looking for the end of the frame again
+            wanted = 2 * pending.size();
+        }
+        else {
+            // Too large to decompress as a whole: finish what is in flight, then stream everything that is left
+            while (!in_flight.empty()) {
+                deliver_oldest();
+            }
+            source.clear();
+            source.seekg(offset);
+            ZstdInputBuffer buffer(source);
+            std::vector<char> chunk(ZSTD_DStreamOutSize());
+            std::streamsize got;
+            while ((got = buffer.sgetn(chunk.data(), std::streamsize(chunk.size()))) > 0) {
+                consume(chunk.data(), size_t(got));
+            }
+            return ok && buffer.Finished();
+        }
+    }
+    while (!in_flight.empty()) {
+        deliver_oldest();
+    }
+    return ok;
+}
+#endif
+
+/*
+Reads the file at 'path' as a sequence of line ids. Compressed files are recognised by their magic number
+and decompressed on the fly: gzip needs MYERS_WITH_ZLIB and zstd needs MYERS_WITH_ZSTD.
+
+@return  false if the file could not be read
+*/
+bool ReadLines(const std::string& path, LineInterner& interner, std::vector<int>& ids) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    unsigned char magic[4] = { 0 };
+    file.read(reinterpret_cast<char*>(magic), 4);
+    file.clear();
+    file.seekg(0);
+
+    std::string carry;
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef MYERS_WITH_ZSTD
+        bool ok = DecompressZstd(file, [&](const char* data, size_t size) {
+            if (size > 0) {
+                InternLines(data, size, carry, interner, ids);
+            }
+        });
+        InternLines(nullptr, 0, carry, interner, ids);
+        return ok;
+#else
+        std::cerr << path << ": zstd input needs a build with MYERS_WITH_ZSTD\n";
+        return false;
+#endif
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifdef MYERS_WITH_ZLIB
+        gzFile gz = gzopen(path.c_str(), "rb");
+        if (!gz) {
+            return false;
+        }
+        std::vector<char> buffer(1 << 16);
+        int size;
+        while ((size = gzread(gz, buffer.data(), unsigned(buffer.size()))) > 0) {
+            InternLines(buffer.data(), size, carry, interner, ids);
+        }
+        gzclose(gz);
+        InternLines(nullptr, 0, carry, interner, ids);
+        return size == 0;
+#else
+        std::cerr << path << ": gzip input needs a build with MYERS_WITH_ZLIB\n";
+        return false;
+#endif
+    }
+
+    std::vector<char> buffer(1 << 16);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        InternLines(buffer.data(), size_t(file.gcount()), carry, interner, ids);
+    }
+    InternLines(nullptr, 0, carry, interner, ids);
+    return true;
+}
+
+// Writes 'diff' line by line, prefixing deleted lines with '-', inserted lines with '+' and unchanged ones with ' '
+void WriteLines(std::ostream& out, const std::vector<int>& old_ids, const std::vector<int>& new_ids, const Diff& diff, const LineInterner& interner) {
+    ForEachEditRun(diff, int(old_ids.size()), int(new_ids.size()), [&](const EditRun& run) {
+        for (int i = 0; i < run.length; i++) {
+            out << run.op << (run.op == '+' ? interner.Text(new_ids[run.new_pos + i]) : interner.Text(old_ids[run.old_pos + i])) << "\n";
+        }
+    });
+}
+
+/*
+What a diff of two growing files needs to resume where the last one stopped: how many lines of each file it
+covered, an FNV-1a hash of those lines, the LineMask it compared them under, and its edit script. As long as
+both files only grew since and the mask is the same, that script still holds for the lines it covered, and
+only the appended tails are left to diff (see ResumeDiff).
+
+The file format is text:
+
+    myers-diff checkpoint 2
+    <old lines> <old hash> <new lines> <new hash>
+    <mask>                        (LineMask::Fingerprint)
+    <number of edits>
+    <position> del|add            (one line per edit)
+*/
+struct DiffCheckpoint {
+    int old_length = 0;
+    uint64_t old_hash = 0;
+    int new_length = 0;
+    uint64_t new_hash = 0;
+    uint64_t mask = 0;
+    Diff edits;
+
+    bool Write(const std::string& path) const {
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+        return Write(out);
+    }
+
+    bool Write(std::ostream& out) const {
+        out << "myers-diff checkpoint 2\n" << old_length << " " << old_hash << " " << new_length << " " << new_hash << "\n" << mask << "\n" << edits.size() << "\n";
+        for (Diff::const_iterator it = edits.begin(); it != edits.end(); it++) {
+            out << it->first << " " << it->second << "\n";
+        }
+        return bool(out.flush());
+    }
+
+    // Returns false, leaving this unchanged, when 'path' is missing or not a valid checkpoint
+    bool Read(const std::string& path) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        return Read(in);
+    }
+
+    bool Read(std::istream& in) {
+        std::string header;
+        if (!std::getline(in, header) || header != "myers-diff checkpoint 2") {
+            return false;
+        }
+        DiffCheckpoint read;
+        size_t count = 0;
+        if (!(in >> read.old_length >> read.old_hash >> read.new_length >> read.new_hash >> read.mask >> count)) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            int pos;
+            std::string kind;
+            if (!(in >> pos >> kind) || (kind != "del" && kind != "add") || pos < 0 || pos >= (kind == "del" ? read.old_length : read.new_length)) {
+                return false;
+            }
+            read.edits.insert(read.edits.end(), std::make_pair(pos, kind));
+        }
+        *this = std::move(read);
+        return true;
+    }
+};
+
+// Continues 'hash', an FNV-1a hash of lines [0, first) of 'ids', over lines [first, last); 'hash' is ignored when first is 0
+uint64_t HashLines(uint64_t hash, const std::vector<int>& ids, int first, int last, const LineInterner& interner) {
+    if (first == 0) {
+        hash = 14695981039346656037ull;
+    }
+    for (int i = first; i < last; i++) {
+        const std::string& text = interner.Text(ids[i]);
+        for (unsigned char c : text) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        hash = (hash ^ '\n') * 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+Whether 'checkpoint' holds for these lines: it was taken under the same masks ('mask', see LineMask::Fingerprint)
+from prefixes of them. Sets 'old_hash' and 'new_hash' to the hashes of the prefixes it covers, for HashLines to
+continue over the rest.
+*/
+bool CheckpointApplies(const DiffCheckpoint& checkpoint, const std::vector<int>& old_ids, const std::vector<int>& new_ids,
+                       const LineInterner& interner, uint64_t mask, uint64_t& old_hash, uint64_t& new_hash) {
+    // A checkpoint taken under other masks compared other keys, so its edits do not carry over
+    bool fits = checkpoint.mask == mask && checkpoint.old_length <= int(old_ids.size()) && checkpoint.new_length <= int(new_ids.size());
+    old_hash = HashLines(0, old_ids, 0, fits ? checkpoint.old_length : 0, interner);
+    new_hash = HashLines(0, new_ids, 0, fits ? checkpoint.new_length : 0, interner);
+    return fits && old_hash == checkpoint.old_hash && new_hash == checkpoint.new_hash;
+}
+
+/*
+The edit script for sequences that extend the ones 'checkpoint' was taken from: its edits for the first
+checkpoint.old_length and checkpoint.new_length elements, followed by DiffSequences of only the tails added
+since. The cost is proportional to the tails. The result is a valid script, though not necessarily a minimal
+one, since the path is made to pass through the point where the checkpoint ended. The caller checks that the
+checkpoint matches the inputs' prefixes (see CheckpointApplies).
+*/
+Diff ResumeDiff(const DiffCheckpoint& checkpoint, const int old_sequence[], int N, const int new_sequence[], int M,
+                const Options& options = Options()) {
+    int x = checkpoint.old_length, y = checkpoint.new_length;
+    Diff rtn = checkpoint.edits;
+    Diff tail = DiffGaps(nullptr, old_sequence, new_sequence, { DiffGap{ x, y, N - x, M - y } }, options);
+    rtn.insert(tail.begin(), tail.end());
+    return rtn;
+}
+
+/*
+Compares two files line by line:
+
+    myers-diff OLD NEW [--html REPORT] [--zstd LEVEL] [--stats] [--memory-limit BYTES] [--lcs] [--unordered]
+                       [--anchored TEXT]... [--mask REGEX]... [--mask-field N]... [--field-separator C]
+                       [--mask-numbers] [--checkpoint FILE]
+    myers-diff OLD NEW --binary [--block BYTES]
+
+Either file may be gzip or zstd compressed. '--html' writes an HTML report instead of the listing on standard
+output (so it is refused with '--lcs', '--unordered' and '--binary'), and '--zstd' compresses everything written to standard output, whichever listing it is. '--stats'
+reports the diff's memory use on standard error, and '--memory-limit' caps it (see Options::memory_limit), so
+it is refused with the modes it does not cover. '--lcs' prints the matching runs instead, one
+'<old line> <new line> <length>' per line, counting lines from 0. '--unordered' compares the files as sets of
+lines (see UnorderedDiff) and lists the removed lines, then the added ones. '--anchored' makes lines that start
+with TEXT and occur once in each file line up, as with git (see AnchoredDiff). The '--mask' options make lines
+that differ only in timestamps, ids and the like compare equal (see LineMask); they are still printed as
+they are. '--checkpoint' is for files that keep growing: when FILE holds a checkpoint whose lines are still
+the start of both files, only the lines appended since are diffed (see ResumeDiff), and FILE is then updated
+for the next run; a checkpoint taken under other '--mask' options is not resumed. It only resumes the plain
+diff, so it is refused with '--anchored', '--lcs', '--unordered' and '--binary'.
+
+'--binary' compares the files byte by byte with BlockMatchDelta instead, and prints the delta that rebuilds NEW
+from OLD: 'copy <old offset> <length>' and 'insert <new offset> <length> <bytes in hex>' lines.
+*/
+int RunCommandLine(int argc, char* argv[]) {
+    std::string html;
+    int zstd_level = 0;
+    bool stats = false;
+    bool lcs = false;
+    bool unordered = false;
+    std::vector<std::string> anchored;
+    LineMask mask;
+    std::string checkpoint_path;
+    bool binary = false;
+    int block = 64;
+    Options options;
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--html" && i + 1 < argc) {
+            html = argv[++i];
+        }
+        else if (arg == "--zstd" && i + 1 < argc) {
+            zstd_level = std::atoi(argv[++i]);
+        }
+        else if (arg == "--stats") {
+            stats = true;
+        }
+        else if (arg == "--memory-limit" && i + 1 < argc) {
+            options.memory_limit = std::atoll(argv[++i]);
+        }
+        else if (arg == "--lcs") {
+            lcs = true;
+        }
+        else if (arg == "--unordered") {
+            unordered = true;
+        }
+        else if (arg == "--anchored" && i + 1 < argc) {
+            anchored.push_back(argv[++i]);
+        }
+        else if (arg == "--mask" && i + 1 < argc) {
+            try {
+                mask.AddPattern(argv[++i]);
+            }
+            catch (const std::invalid_argument& e) {
+                std::cerr << "bad --mask " << argv[i] << ": " << e.what() << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--mask-field" && i + 1 < argc) {
+            mask.AddField(std::atoi(argv[++i]));
+        }
+        else if (arg == "--field-separator" && i + 1 < argc) {
+            mask.SetSeparator(argv[++i][0]);
+        }
+        else if (arg == "--mask-numbers") {
+            mask.MaskNumbers(true);
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        }
+        else if (arg == "--binary") {
+            binary = true;
+        }
+        else if (arg == "--block" && i + 1 < argc) {
+            block = std::atoi(argv[++i]);
+        }
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+    if (zstd_level > 0 && !html.empty()) {
+        std::cerr << "--zstd compresses standard output, --html writes files\n";
+        return 2;
+    }
+    if (!html.empty() && (lcs || unordered || binary)) {
+        std::cerr << "--html reports a line diff, not --lcs, --unordered or --binary\n";
+        return 2;
+    }
+    if (options.memory_limit > 0 && (lcs || unordered || binary)) {
+        std::cerr << "--memory-limit does not bound --lcs, --unordered or --binary\n";
+        return 2;
+    }
+    if (!checkpoint_path.empty() && (!anchored.empty() || lcs || unordered || binary)) {
+        std::cerr << "--checkpoint only resumes the plain diff, not --anchored, --lcs, --unordered or --binary\n";
+        return 2;
+    }
+
+    // Every listing below goes to 'out', which is standard output, compressed with --zstd
+#ifdef MYERS_WITH_ZSTD
+    std::unique_ptr<ZstdOutputBuffer> compressed;
+    if (zstd_level > 0) {
+        compressed.reset(new ZstdOutputBuffer(std::cout, zstd_level, int(std::thread::hardware_concurrency())));
+    }
+    std::ostream out(compressed ? static_cast<std::streambuf*>(compressed.get()) : std::cout.rdbuf());
+#else
+    if (zstd_level > 0) {
+        std::cerr << "--zstd needs a build with MYERS_WITH_ZSTD\n";
+        return 2;
+    }
+    std::ostream out(std::cout.rdbuf());
+#endif
+
+    if (binary) {
+        std::string data[2];
+        for (int i = 1; i <= 2; i++) {
+            std::ifstream file(argv[i], std::ios::binary);
+            if (!file) {
+                std::cerr << "cannot read " << argv[i] << "\n";
+                return 2;
+            }
+            data[i - 1].assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        ThreadPool pool;
+        std::vector<DeltaOp> delta;
+        GlobalAllocationStats().Reset();
+        try {
+            delta = BlockMatchDelta(pool, reinterpret_cast<const unsigned char*>(data[0].data()), int(data[0].size()),
+                                    reinterpret_cast<const unsigned char*>(data[1].data()), int(data[1].size()), block);
+        }
+        catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << "\n";
+            return 2;
+        }
+        if (stats) {
+            GlobalAllocationStats().Write(std::cerr);
+        }
+        for (const DeltaOp& op : delta) {
+            if (op.op == 'c') {
+                out << "copy " << op.old_pos << " " << op.length << "\n";
+            }
+            else {
+                static const char digits[] = "0123456789abcdef";
+                out << "insert " << op.new_pos << " " << op.length << " ";
+                for (int i = op.new_pos; i < op.new_pos + op.length; i++) {
+                    unsigned char byte = (unsigned char)data[1][i];
+                    out << digits[byte >> 4] << digits[byte & 15];
+                }
+                out << "\n";
+            }
+        }
+        return data[0] == data[1] ? 0 : 1;
+    }
+
+    LineInterner interner;
+    interner.SetMask(&mask);
+    std::vector<int> old_ids, new_ids;
+    for (int i = 1; i <= 2; i++) {
+        if (!ReadLines(argv[i], interner, i == 1 ? old_ids : new_ids)) {
+            std::cerr << "cannot read " << argv[i] << "\n";
+            return 2;
+        }
+    }
+    // The diff compares keys, the output prints ids
+    std::vector<int> old_keys = interner.Keys(old_ids), new_keys = interner.Keys(new_ids);
+
+    GlobalAllocationStats().Reset();
+    if (lcs) {
+        std::vector<Snake> snakes;
+        CommonSnakes(old_keys.data(), int(old_keys.size()), new_keys.data(), int(new_keys.size()), 0, 0, snakes);
+        if (stats) {
+            GlobalAllocationStats().Write(std::cerr);
+        }
+        for (const Snake& snake : snakes) {
+            out << snake.x << " " << snake.y << " " << snake.length << "\n";
+        }
+        bool equal = old_keys == new_keys;
+        return equal ? 0 : 1;
+    }
+    if (unordered) {
+        ThreadPool pool;
+        Diff result = UnorderedDiff(pool, old_keys.data(), int(old_keys.size()), new_keys.data(), int(new_keys.size()));
+        if (stats) {
+            GlobalAllocationStats().Write(std::cerr);
+        }
+        for (const char* kind : { "del", "add" }) {
+            for (Diff::const_iterator it = result.begin(); it != result.end(); it++) {
+                if (it->second == kind) {
+                    out << (*kind == 'd' ? '-' : '+') << interner.Text((*kind == 'd' ? old_ids : new_ids)[it->first]) << "\n";
+                }
+            }
+        }
+        return result.empty() ? 0 : 1;
+    }
+
+    auto text = [&interner](int id) { return interner.Text(id); };
+    if (!html.empty() && anchored.empty() && checkpoint_path.empty() && options.memory_limit == 0) {
+        // Nothing here needs the whole script, so the report is written as the script is computed
+        LazyEditScript script(old_keys.data(), int(old_keys.size()), new_keys.data(), int(new_keys.size()));
+        bool written = WriteHtmlReport(old_ids.data(), int(old_ids.size()), new_ids.data(), int(new_ids.size()), script, html, text);
+        if (stats) {
+            GlobalAllocationStats().Write(std::cerr);
+        }
+        if (!written) {
+            std::cerr << "cannot write " << html << "\n";
+            return 2;
+        }
+        return old_keys == new_keys ? 0 : 1;
+    }
+
+    Diff result;
+    try {
+        if (!anchored.empty()) {
+            ThreadPool pool;
+            auto is_anchor = [&](int id) {
+                const std::string& text = interner.Text(id);
+                for (const std::string& prefix : anchored) {
+                    if (text.compare(0, prefix.size(), prefix) == 0) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            result = AnchoredDiff(pool, old_keys.data(), int(old_keys.size()), new_keys.data(), int(new_keys.size()), is_anchor, options);
+        }
+        else if (!checkpoint_path.empty()) {
+            DiffCheckpoint checkpoint;
+            int N = int(old_ids.size()), M = int(new_ids.size());
+            uint64_t old_hash = 0, new_hash = 0;
+            if (checkpoint.Read(checkpoint_path) && CheckpointApplies(checkpoint, old_ids, new_ids, interner, mask.Fingerprint(), old_hash, new_hash)) {
+                result = ResumeDiff(checkpoint, old_keys.data(), N, new_keys.data(), M, options);
+            }
+            else {
+                checkpoint = DiffCheckpoint();
+                result = DiffSequences(old_keys.data(), N, new_keys.data(), M, options);
+            }
+            checkpoint.old_hash = HashLines(old_hash, old_ids, checkpoint.old_length, N, interner);
+            checkpoint.new_hash = HashLines(new_hash, new_ids, checkpoint.new_length, M, interner);
+            checkpoint.old_length = N;
+            checkpoint.new_length = M;
+            checkpoint.mask = mask.Fingerprint();
+            checkpoint.edits = result;
+            if (!checkpoint.Write(checkpoint_path)) {
+                std::cerr << "cannot write " << checkpoint_path << "\n";
+                return 2;
+            }
+        }
+        else {
+            result = DiffSequences(old_keys.data(), int(old_keys.size()), new_keys.data(), int(new_keys.size()), options);
+        }
+    }
+    catch (const MemoryLimitExceeded& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    if (stats) {
+        GlobalAllocationStats().Write(std::cerr);
+    }
+    if (!html.empty()) {
+        if (!WriteHtmlReport(old_ids.data(), int(old_ids.size()), new_ids.data(), int(new_ids.size()), result, html, text)) {
+            std::cerr << "cannot write " << html << "\n";
+            return 2;
+        }
+    }
+    else {
+        WriteLines(out, old_ids, new_ids, result, interner);
+    }
+    return result.empty() ? 0 : 1;
+}
+
+#ifdef MYERS_WITH_ZLIB
+/*
+Inflates a zlib stream. 'size' is the expected output size when it is known (pack entries record it), or 0.
+
+@return  false if the stream is corrupt or ends early
+*/
+bool Inflate(const unsigned char* data, size_t data_size, size_t size, std::string& out) {
+    z_stream stream = z_stream();
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+    out.assign(size ? size : 4 * data_size + 64, '\0');
+    stream.next_in = const_cast<unsigned char*>(data);
+    stream.avail_in = uInt(std::min<size_t>(data_size, UINT32_MAX));
+    int status = Z_OK;
+    while (status == Z_OK) {
+        if (stream.total_out == out.size()) {
+            if (size) {
+                break;
+            }
+            out.resize(2 * out.size());
+        }
+        stream.next_out = reinterpret_cast<unsigned char*>(&out[stream.total_out]);
+        stream.avail_out = uInt(std::min<size_t>(out.size() - stream.total_out, UINT32_MAX));
+        status = inflate(&stream, Z_NO_FLUSH);
+    }
+    out.resize(stream.total_out);
+    inflateEnd(&stream);
+    return status == Z_STREAM_END || (size && out.size() == size && status == Z_OK);
+}
+
+// A read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const unsigned char*>(data);
+                size_ = size_t(st.st_size);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    virtual ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<unsigned char*>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const unsigned char* data_;
+    size_t size_;
+};
+
+/*
+Reads objects straight out of a git repository: loose objects, and objects in packfiles including
+OFS_DELTA/REF_DELTA chains. Pack indexes (version 2) and packs are memory mapped and never modified, so one
+repository can be read from any number of threads at once.
+*/
+class GitRepository {
+public:
+    // 'git_dir' is the .git directory (or the root of a bare repository)
+    GitRepository(const std::string& git_dir) : git_dir_(git_dir) {
+        std::string pack_dir = git_dir + "/objects/pack";
+        if (DIR* dir = opendir(pack_dir.c_str())) {
+            while (dirent* entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0) {
+                    std::string base = pack_dir + "/" + name.substr(0, name.size() - 4);
+                    std::unique_ptr<Pack> pack(new Pack{ MappedFile(base + ".idx"), MappedFile(base + ".pack") });
+                    const unsigned char* idx = pack->index.data();
+                    // Only version 2 indexes ("\377tOc", version 2) are understood
+                    if (pack->index.size() >= 8 + 256 * 4 && pack->pack.data() && idx[0] == 0xff && idx[1] == 't' && idx[2] == 'O' && idx[3] == 'c' && ReadBigEndian(idx + 4) == 2) {
+                        packs_.push_back(std::move(pack));
+                    }
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    /*
+    Resolves 'name' to an object id: a full hex id, HEAD, or a ref such as 'main', 'v1.0' or 'refs/heads/main'.
+
+    @return  The 40 digit hex id, or an empty string
+    */
+    std::string Resolve(const std::string& name) const {
+        if (name.size() == 40 && name.find_first_not_of("0123456789abcdef") == std::string::npos) {
+            return name;
+        }
+        const char* prefixes[] = { "", "refs/", "refs/tags/", "refs/heads/", "refs/remotes/" };
+        for (const char* prefix : prefixes) {
+            std::string ref = prefix + name;
+            std::ifstream file(git_dir_ + "/" + ref);
+            std::string line;
+            if (file && std::getline(file, line)) {
+                if (line.compare(0, 5, "ref: ") == 0) {
+                    return Resolve(line.substr(5));
+                }
+                return line.substr(0, 40);
+            }
+            std::ifstream packed(git_dir_ + "/packed-refs");
+            while (std::getline(packed, line)) {
+                if (line.size() > 41 && line.compare(41, std::string::npos, ref) == 0) {
+                    return line.substr(0, 40);
+                }
+            }
+        }
+        return std::string();
+    }
+
+    /*
+    Reads the object with the given hex id.
+
+    @type  Set to "blob", "tree", "commit" or "tag"
+
+    @return  false if the object does not exist or cannot be read
+    */
+    bool Read(const std::string& oid, std::string& type, std::string& data) const {
+        unsigned char raw[20];
+        if (oid.size() != 40 || !ParseOid(oid, raw)) {
+            return false;
+        }
+        return Read(raw, type, data);
+    }
+
+    bool Read(const unsigned char oid[20], std::string& type, std::string& data) const {
+        return Read(oid, type, data, 0);
+    }
+
+    static bool ParseOid(const std::string& hex, unsigned char oid[20]) {
+        for (int i = 0; i < 20; i++) {
+            int high = HexDigit(hex[2 * i]), low = HexDigit(hex[2 * i + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            oid[i] = (unsigned char)(high << 4 | low);
+        }
+        return true;
+    }
+
+    static std::string OidToHex(const unsigned char oid[20]) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(40, '0');
+        for (int i = 0; i < 20; i++) {
+            hex[2 * i] = digits[oid[i] >> 4];
+            hex[2 * i + 1] = digits[oid[i] & 15];
+        }
+        return hex;
+    }
+
+private:
+    // git never writes delta chains deeper than 4095; anything deeper is corrupt or cyclic
+    static const int kMaxDeltaDepth = 4096;
+
+    struct Pack {
+        MappedFile index;
+        MappedFile pack;
+    };
+
+    // Read for an object needed 'depth' deltas down a delta chain
+    bool Read(const unsigned char oid[20], std::string& type, std::string& data, int depth) const {
+        for (const std::unique_ptr<Pack>& pack : packs_) {
+            size_t offset;
+            if (Find(*pack, oid, offset)) {
+                int kind = ReadPacked(*pack, offset, data, depth);
+                static const char* names[] = { "", "commit", "tree", "blob", "tag" };
+                if (kind < 1 || kind > 4) {
+                    return false;
+                }
+                type = names[kind];
+                return true;
+            }
+        }
+        // Loose objects live in objects/xx/yyyy..., zlib compressed, after a "<type> <size>\0" header
+        std::string hex = OidToHex(oid);
+        MappedFile file(git_dir_ + "/objects/" + hex.substr(0, 2) + "/" + hex.substr(2));
+        std::string object;
+        if (!file.data() || !Inflate(file.data(), file.size(), 0, object)) {
+            return false;
+        }
+        size_t space = object.find(' ');
+        size_t nul = object.find('\0');
+        if (space == std::string::npos || nul == std::string::npos || space > nul) {
+            return false;
+        }
+        type = object.substr(0, space);
+        data = object.substr(nul + 1);
+        return true;
+    }
+
+    static int HexDigit(char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    }
+
+    static uint32_t ReadBigEndian(const unsigned char* p) {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    // Looks 'oid' up in the index: the fan-out table narrows it down to ids with the same first byte
+    static bool Find(const Pack& pack, const unsigned char oid[20], size_t& offset) {
+        if (pack.index.size() < 8 + 256 * 4) {
+            return false;
+        }
+        const unsigned char* fanout = pack.index.data() + 8;
+        uint32_t count = ReadBigEndian(fanout + 255 * 4);
+        const unsigned char* oids = fanout + 256 * 4;
+        if (pack.index.size() < 8 + 256 * 4 + size_t(count) * 28) {
+            return false;
+        }
+        uint32_t low = oid[0] ? ReadBigEndian(fanout + (oid[0] - 1) * 4) : 0;
+        uint32_t high = ReadBigEndian(fanout + oid[0] * 4);
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            int order = std::memcmp(oids + size_t(middle) * 20, oid, 20);
+            if (order == 0) {
+                // Offsets follow the ids and their CRCs; large ones point into a table of 64 bit offsets
+                const unsigned char* offsets = oids + size_t(count) * 24;
+                uint32_t small = ReadBigEndian(offsets + size_t(middle) * 4);
+                if (small & 0x80000000u) {
+                    const unsigned char* large = offsets + size_t(count) * 4 + size_t(small & 0x7fffffffu) * 8;
+                    if (large + 8 > pack.index.data() + pack.index.size()) {
+                        return false;
+                    }
+                    offset = size_t(uint64_t(ReadBigEndian(large)) << 32 | ReadBigEndian(large + 4));
+                }
+                else {
+                    offset = small;
+                }
+                return true;
+            }
+            if (order < 0) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        return false;
+    }
+
+    /*
+    Reads the pack entry at 'offset', following delta chains back to their base. 'depth' counts the deltas
+    already followed, so a chain that loops back on itself fails instead of recursing forever.
+
+    @return  The object type (1 commit, 2 tree, 3 blob, 4 tag) or 0 on error
+    */
+    int ReadPacked(const Pack& pack, size_t offset, std::string& data, int depth) const {
+        const unsigned char* start = pack.pack.data();
+        const unsigned char* end = start + pack.pack.size();
+        const unsigned char* p = start + offset;
+        if (offset >= pack.pack.size() || depth > kMaxDeltaDepth) {
+            return 0;
+        }
+        // Header: 3 bits of type, then the inflated size as a little endian base 128 varint
+        int kind = (*p >> 4) & 7;
+        size_t size = *p & 15;
+        for (int shift = 4; *p & 0x80; shift += 7) {
+            if (++p == end) return 0;
+            size |= size_t(*p & 0x7f) << shift;
+        }
+        p++;
+
+        std::string base;
+        bool delta = kind == 6 || kind == 7;
+        if (delta && p == end) {
+            return 0;
+        }
+        if (kind == 6) {
+            // OFS_DELTA: the base is an earlier entry of this pack, a big endian varint back from here
+            size_t distance = *p & 0x7f;
+            while (*p & 0x80) {
+                if (++p == end) return 0;
+                distance = ((distance + 1) << 7) | (*p & 0x7f);
+            }
+            p++;
+            if (distance == 0 || distance > offset) {
+                return 0;
+            }
+            kind = ReadPacked(pack, offset - distance, base, depth + 1);
+        }
+        else if (kind == 7) {
+            // REF_DELTA: the base is named by id, and may be anywhere in the repository
+            if (end - p < 20) {
+                return 0;
+            }
+            std::string type;
+            static const char* names[] = { "", "commit", "tree", "blob", "tag" };
+            if (!Read(p, type, base, depth + 1)) {
+                return 0;
+            }
+            kind = int(std::find(names, names + 5, type) - names);
+            p += 20;
+        }
+        if (kind < 1 || kind > 4 || !Inflate(p, size_t(end - p), size, data)) {
+            return 0;
+        }
+        if (delta && !ApplyDelta(base, data)) {
+            return 0;
+        }
+        return kind;
+    }
+
+    // Rebuilds an object from its base and a git delta: copy instructions reference the base, inserts carry new bytes
+    static bool ApplyDelta(const std::string& base, std::string& delta) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(delta.data());
+        const unsigned char* end = p + delta.size();
+        size_t sizes[2] = { 0, 0 };
+        for (size_t& size : sizes) {
+            for (int shift = 0; p < end; shift += 7) {
+                size |= size_t(*p & 0x7f) << shift;
+                if (!(*p++ & 0x80)) break;
+            }
+        }
+        if (sizes[0] != base.size()) {
+            return false;
+        }
+        std::string result;
+        result.reserve(sizes[1]);
+        while (p < end) {
+            unsigned char op = *p++;
+            if (op & 0x80) {
+                size_t copy_offset = 0, copy_size = 0;
+                for (int i = 0; i < 4; i++) {
+                    if (op & (1 << i)) {
+                        if (p == end) return false;
+                        copy_offset |= size_t(*p++) << (8 * i);
+                    }
+                }
+                for (int i = 0; i < 3; i++) {
+                    if (op & (16 << i)) {
+                        if (p == end) return false;
+                        copy_size |= size_t(*p++) << (8 * i);
+                    }
+                }
+                if (copy_size == 0) {
+                    copy_size = 0x10000;
+                }
+                if (copy_offset + copy_size > base.size()) {
+                    return false;
+                }
+                result.append(base, copy_offset, copy_size);
+            }
+            else if (op) {
+                if (size_t(end - p) < op) {
+                    return false;
+                }
+                result.append(reinterpret_cast<const char*>(p), op);
+                p += op;
+            }
+            else {
+                return false;
+            }
+        }
+        if (result.size() != sizes[1]) {
+            return false;
+        }
+        delta.swap(result);
+        return true;
+    }
+
+    std::string git_dir_;
+    std::vector<std::unique_ptr<Pack>> packs_;
+};
+
+// A file that differs between two trees; an empty id stands for a file that only exists on the other side
+struct GitChange {
+    std::string path;
+    std::string old_oid;
+    std::string new_oid;
+    // A submodule (gitlink) whose ids name commits in another repository, which are not read
+    bool submodule = false;
+};
+
+/*
+Collects the files that differ between two tree objects, recursing into subtrees. Entries whose ids are
+equal are skipped without being read, so unchanged directories cost one comparison each. Commits are
+accepted too and stand for their root tree.
+
+@return  false if one of the objects could not be read
+*/
+bool DiffGitTrees(const GitRepository& repo, const std::string& old_tree, const std::string& new_tree, const std::string& prefix, std::vector<GitChange>& changes) {
+    enum { kFile, kTree, kGitlink };
+    // name -> (kind, id)
+    std::map<std::string, std::pair<int, std::string>> entries[2];
+    const std::string* trees[2] = { &old_tree, &new_tree };
+    for (int side = 0; side < 2; side++) {
+        if (trees[side]->empty()) {
+            continue;
+        }
+        std::string type, data;
+        if (!repo.Read(*trees[side], type, data)) {
+            return false;
+        }
+        if (type == "commit") {
+            if (data.compare(0, 5, "tree ") != 0 || !repo.Read(data.substr(5, 40), type, data)) {
+                return false;
+            }
+        }
+        if (type != "tree") {
+            return false;
+        }
+        // Entries are "<octal mode> <name>\0<20 byte id>"
+        for (size_t pos = 0; pos < data.size();) {
+            size_t space = data.find(' ', pos);
+            size_t nul = data.find('\0', space);
+            if (space == std::string::npos || nul == std::string::npos || nul + 21 > data.size()) {
+                return false;
+            }
+            int kind = data.compare(pos, space - pos, "40000") == 0 ? kTree : data.compare(pos, space - pos, "160000") == 0 ? kGitlink : kFile;
+            std::string oid = GitRepository::OidToHex(reinterpret_cast<const unsigned char*>(data.data() + nul + 1));
+            entries[side][data.substr(space + 1, nul - space - 1)] = std::make_pair(kind, oid);
+            pos = nul + 21;
+        }
+    }
+
+    std::map<std::string, std::pair<int, std::string>>::iterator old_it = entries[0].begin(), new_it = entries[1].begin();
+    while (old_it != entries[0].end() || new_it != entries[1].end()) {
+        bool take_old = new_it == entries[1].end() || (old_it != entries[0].end() && old_it->first <= new_it->first);
+        bool take_new = old_it == entries[0].end() || (new_it != entries[1].end() && new_it->first <= old_it->first);
+        const std::string& name = take_old ? old_it->first : new_it->first;
+        std::pair<int, std::string> none(kFile, std::string());
+        const std::pair<int, std::string>& old_entry = take_old ? old_it->second : none;
+        const std::pair<int, std::string>& new_entry = take_new ? new_it->second : none;
+        if (old_entry.second != new_entry.second) {
+            // Each side contributes the id of the kind asked for, or nothing; a file replaced by a directory
+            // (or a submodule) shows up as both
+            auto id_of = [](const std::pair<int, std::string>& entry, int kind) { return entry.first == kind ? entry.second : std::string(); };
+            std::string old_tree = id_of(old_entry, kTree), new_tree = id_of(new_entry, kTree);
+            if (old_tree != new_tree && !DiffGitTrees(repo, old_tree, new_tree, prefix + name + "/", changes)) {
+                return false;
+            }
+            std::string old_blob = id_of(old_entry, kFile), new_blob = id_of(new_entry, kFile);
+            if (old_blob != new_blob) {
+                changes.push_back(GitChange{ prefix + name, old_blob, new_blob });
+            }
+            std::string old_commit = id_of(old_entry, kGitlink), new_commit = id_of(new_entry, kGitlink);
+            if (old_commit != new_commit) {
+                changes.push_back(GitChange{ prefix + name, old_commit, new_commit, true });
+            }
+        }
+        if (take_old) old_it++;
+        if (take_new) new_it++;
+    }
+    return true;
+}
+
+/*
+Compares two git objects:
+
+    myers-diff --git GIT_DIR OLD NEW [--numa-stats]
+
+OLD and NEW are ids or refs. Two blobs are compared line by line; two trees (or commits) are compared file by
+file, with the changed files diffed in parallel and printed in path order. '--numa-stats' reports on standard
+error how much of the workers' memory was on their own node.
+*/
+int RunGitCommandLine(int argc, char* argv[]) {
+    bool numa_stats = argc == 6 && std::string(argv[5]) == "--numa-stats";
+    if (argc != 5 && !numa_stats) {
+        std::cerr << "usage: " << argv[0] << " --git GIT_DIR OLD NEW [--numa-stats]\n";
+        return 2;
+    }
+    GitRepository repo(argv[2]);
+    std::string old_oid = repo.Resolve(argv[3]), new_oid = repo.Resolve(argv[4]);
+    std::string type;
+    std::string data;
+    if (old_oid.empty() || new_oid.empty() || !repo.Read(old_oid, type, data)) {
+        std::cerr << "cannot read " << (old_oid.empty() || new_oid.empty() ? "revisions" : argv[3]) << "\n";
+        return 2;
+    }
+
+    std::vector<GitChange> changes;
+    if (type == "blob") {
+        changes.push_back(GitChange{ argv[3], old_oid, new_oid });
+    }
+    else if (!DiffGitTrees(repo, old_oid, new_oid, "", changes)) {
+        std::cerr << "cannot read trees\n";
+        return 2;
+    }
+
+    std::atomic<bool> ok(true);
+    ThreadPool pool;
+    std::vector<std::future<std::string>> output;
+    for (size_t i = 0; i < changes.size(); i++) {
+        output.push_back(pool.Submit([&, i]() {
+            LineInterner interner;
+            std::vector<int> ids[2];
+            const std::string* oids[2] = { &changes[i].old_oid, &changes[i].new_oid };
+            for (int side = 0; side < 2 && !changes[i].submodule; side++) {
+                std::string blob_type, blob, carry;
+                if (!oids[side]->empty()) {
+                    if (!repo.Read(*oids[side], blob_type, blob)) {
+                        ok = false;
+                        continue;
+                    }
+                    InternLines(blob.data(), blob.size(), carry, interner, ids[side]);
+                    InternLines(nullptr, 0, carry, interner, ids[side]);
+                }
+            }
+            Diff result = DiffSequences(ids[0].data(), int(ids[0].size()), ids[1].data(), int(ids[1].size()));
+            if (numa_stats) {
+                RecordNumaPlacement(ids[0].data(), ids[0].size() * sizeof(int));
+                RecordNumaPlacement(ids[1].data(), ids[1].size() * sizeof(int));
+            }
+            std::ostringstream out;
+            out << "diff --git a/" << changes[i].path << " b/" << changes[i].path << "\n";
+            if (changes[i].submodule) {
+                // Only the commit ids are compared, as git does
+                for (int side = 0; side < 2; side++) {
+                    if (!oids[side]->empty()) {
+                        out << (side ? '+' : '-') << "Subproject commit " << *oids[side] << "\n";
+                    }
+                }
+                return out.str();
+            }
+            WriteLines(out, ids[0], ids[1], result, interner);
+            return out.str();
+        }));
+    }
+    for (std::future<std::string>& file : output) {
+        std::cout << file.get();
+    }
+    if (numa_stats) {
+        long long local = GlobalNumaStats().local_pages, remote = GlobalNumaStats().remote_pages;
+        std::cerr << NumaNodeCount() << " NUMA nodes, " << local << " of " << local + remote << " sampled pages node-local\n";
+    }
+    if (!ok) {
+        std::cerr << "cannot read some blobs\n";
+        return 2;
+    }
+    return changes.empty() ? 0 : 1;
+}
+#endif
+
+/*
+Generates one pair of the benchmark corpus. Each kind imitates a real workload at roughly 'size' elements:
+
+    source   a revision of source code: frequent lines ('}', blank) among unique ones, edited in small hunks
+    logs     a rotated log: the window moves on, dropping old lines and appending new ones
+    csv      an export where a few rows change in place and a few move
+    minjs    minified JavaScript compared character by character, with small edits in one long line
+    binary   random bytes with blocks inserted, deleted and overwritten
+
+The same kind, size and seed always give the same pair.
+*/
+void GenerateBenchmarkPair(const std::string& kind, int size, unsigned seed, std::vector<int>& old_sequence, std::vector<int>& new_sequence) {
+    std::mt19937 random(seed);
+    old_sequence.clear();
+    new_sequence.clear();
+    int unique = 1000;
+    if (kind == "source") {
+        for (int i = 0; i < size; i++) {
+            int r = int(random() % 10);
+            old_sequence.push_back(r < 2 ? 0 : r < 3 ? 1 : r < 4 ? 2 + int(random() % 20) : unique++);
+        }
+        for (int i = 0; i < size;) {
+            int r = int(random() % 100);
+            if (r < 3) {
+                // Replace a few lines
+                for (int j = 0, n = 1 + int(random() % 4); j < n; j++) new_sequence.push_back(unique++);
+                i += 1 + int(random() % 4);
+            }
+            else if (r < 5) {
+                // Insert a new block
+                for (int j = 0, n = 1 + int(random() % 10); j < n; j++) new_sequence.push_back(random() % 3 ? unique++ : 0);
+            }
+            else if (r < 6) {
+                // Delete a block
+                i += 1 + int(random() % 10);
+            }
+            else {
+                new_sequence.push_back(old_sequence[i++]);
+            }
+        }
+        new_sequence.resize(std::min(new_sequence.size(), size_t(2 * size)));
+    }
+    else if (kind == "logs") {
+        // Lines carry their own timestamp, so they are all distinct except for a few repeated messages
+        for (int i = 0; i < size + size / 5; i++) {
+            (i < size ? old_sequence : new_sequence).push_back(random() % 4 ? unique + i : int(random() % 50));
+        }
+        std::vector<int> rotated(old_sequence.begin() + size / 5, old_sequence.end());
+        rotated.insert(rotated.end(), new_sequence.begin(), new_sequence.end());
+        new_sequence.swap(rotated);
+    }
+    else if (kind == "csv") {
+        for (int i = 0; i < size; i++) {
+            old_sequence.push_back(unique + i);
+        }
+        new_sequence = old_sequence;
+        for (int i = 0; i < size / 50; i++) {
+            new_sequence[random() % size] = unique + size + i;
+        }
+        for (int i = 0; i < size / 200; i++) {
+            int from = int(random() % new_sequence.size());
+            int row = new_sequence[from];
+            new_sequence.erase(new_sequence.begin() + from);
+            new_sequence.insert(new_sequence.begin() + random() % new_sequence.size(), row);
+        }
+    }
+    else if (kind == "minjs") {
+        const std::string tokens[] = { "function(", "){", "return ", "var ", "=", ";", "}", "this.", "a", "b", "e", "t", "n", "0", "1", ",", "." };
+        while (int(old_sequence.size()) < size) {
+            for (char c : tokens[random() % 17]) old_sequence.push_back(c);
+        }
+        for (size_t i = 0; i < old_sequence.size(); i++) {
+            if (random() % 500 == 0) {
+                for (char c : tokens[random() % 17]) new_sequence.push_back(c);
+            }
+            if (random() % 500 != 0) {
+                new_sequence.push_back(old_sequence[i]);
+            }
+        }
+    }
+    else {
+        for (int i = 0; i < size; i++) {
+            old_sequence.push_back(int(random() % 256));
+        }
+        for (int i = 0; i < size;) {
+            int r = int(random() % 1000);
+            int n = 1 + int(random() % 64);
+            if (r < 2) {
+                for (int j = 0; j < n; j++) new_sequence.push_back(int(random() % 256));
+            }
+            else if (r < 4) {
+                i += n;
+            }
+            else if (r < 6) {
+                for (int j = 0; j < n && i < size; j++, i++) new_sequence.push_back(int(random() % 256));
+            }
+            else {
+                new_sequence.push_back(old_sequence[i++]);
+            }
+        }
+    }
+}
+
+// One measured run of the benchmark, as written to and read from the baseline file
+struct BenchmarkResult {
+    std::string kind;
+    std::string mode;
+    int size;
+    double seconds;
+    double throughput;
+    long long peak_rss_kb;
+    long long edits;
+    // From GlobalAllocationStats(), for the last of the runs
+    long long peak_bytes;
+    long long allocations;
+};
+
+/*
+The input a benchmark mode runs on: the corpus pair itself, except for 'sorted', which diffs the sorted sets of
+distinct values of the two sides (as for key or id sets).
+*/
+void GenerateBenchmarkInput(const std::string& kind, int size, const std::string& mode, std::vector<int>& old_sequence,
+                            std::vector<int>& new_sequence) {
+    GenerateBenchmarkPair(kind, size, 1, old_sequence, new_sequence);
+    if (mode == "sorted") {
+        for (std::vector<int>* sequence : { &old_sequence, &new_sequence }) {
+            std::sort(sequence->begin(), sequence->end());
+            sequence->erase(std::unique(sequence->begin(), sequence->end()), sequence->end());
+        }
+    }
+}
+
+/*
+Diffs one corpus pair with one engine mode:
+
+    default   DiffSequences with default Options
+    scalar    the same with the scalar SnakeKernel, to measure what the SIMD kernels gain
+    plain     ShortestEditScript alone
+    runs      DiffSequences with MatchRuns forced on
+    confusing DiffSequences discarding confusing elements
+    lazy      LazyEditScript, read to the end
+    parallel  ParallelEditScript on a ThreadPool
+    unordered UnorderedDiff
+    anchored  AnchoredDiff, anchored at every value divisible by 8 that occurs once on each side in order
+    block     BlockMatchDiff on the low byte of every element
+    sorted    DiffSequences on sorted inputs, which takes SortedMerge
+
+Small cases take microseconds, so single runs would measure mostly noise: each sample repeats the diff until
+it has run for at least 'sample_seconds', and the result is the fastest of 'samples' samples, per diff (other
+load on the machine only ever makes a sample slower).
+*/
+BenchmarkResult RunBenchmark(const std::string& kind, int size, const std::string& mode, int samples = 7, double sample_seconds = 0.02) {
+    std::vector<int> a, b;
+    GenerateBenchmarkInput(kind, size, mode, a, b);
+    int N = int(a.size()), M = int(b.size());
+    std::vector<unsigned char> old_bytes(a.begin(), a.end()), new_bytes(b.begin(), b.end());
+    std::vector<int> anchors;
+    if (mode == "anchored") {
+        // AnchoredDiff rejects crossing anchors, so keep those whose new positions increase with the old ones
+        std::unordered_map<int, std::pair<int, int>> count, position;
+        for (int i = 0; i < N; i++) {
+            count[a[i]].first++;
+            position[a[i]].first = i;
+        }
+        for (int j = 0; j < M; j++) {
+            count[b[j]].second++;
+            position[b[j]].second = j;
+        }
+        int last = -1;
+        for (int i = 0; i < N; i++) {
+            if (a[i] % 8 == 0 && count[a[i]] == std::make_pair(1, 1) && position[a[i]].second > last) {
+                anchors.push_back(a[i]);
+                last = position[a[i]].second;
+            }
+        }
+    }
+    BenchmarkResult result = { kind, mode, size, 0, 0, 0, 0, 0, 0 };
+    const SnakeKernel& kernel = ActiveSnakeKernel();
+    if (mode == "scalar") {
+        SelectSnakeKernel(ScalarSnakeKernel());
+    }
+    // Created once, so that starting its threads is not measured
+    ThreadPool pool;
+    auto run = [&]() -> long long {
+        if (mode == "lazy") {
+            long long edits = 0;
+            LazyEditScript script(a.data(), N, b.data(), M);
+            for (const LazyEditScript::Hunk& hunk : script) {
+                edits += hunk.old_length + hunk.new_length;
+            }
+            return edits;
+        }
+        else if (mode == "parallel") {
+            long long edits = 0;
+            ParallelEditScript(pool, a.data(), N, b.data(), M, [&edits](const Diff& piece) { edits += piece.size(); });
+            return edits;
+        }
+        else if (mode == "plain") {
+            return ShortestEditScript(a.data(), N, b.data(), M, 0, 0).size();
+        }
+        else if (mode == "unordered") {
+            return UnorderedDiff(pool, a.data(), N, b.data(), M).size();
+        }
+        else if (mode == "anchored") {
+            return AnchoredDiff(pool, a.data(), N, b.data(), M, anchors).size();
+        }
+        else if (mode == "block") {
+            return BlockMatchDiff(pool, old_bytes.data(), N, new_bytes.data(), M).size();
+        }
+        Options options;
+        options.match_runs = mode == "runs" ? 1 : -1;
+        options.discard_confusing = mode == "confusing";
+        return DiffSequences(a.data(), N, b.data(), M, options).size();
+    };
+
+    // Doubles the repeats per sample until one sample lasts long enough
+    int repeats = 1;
+    for (;;) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            result.edits = run();
+        }
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= sample_seconds || repeats >= (1 << 20)) {
+            break;
+        }
+        repeats *= 2;
+    }
+    std::vector<double> seconds;
+    for (int s = 0; s < samples; s++) {
+        GlobalAllocationStats().Reset();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+            run();
+        }
+        seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats);
+        result.peak_bytes = GlobalAllocationStats().total.peak_bytes;
+        result.allocations = GlobalAllocationStats().total.allocations / repeats;
+    }
+    result.seconds = *std::min_element(seconds.begin(), seconds.end());
+    SelectSnakeKernel(kernel);
+    result.throughput = double(N + M) / std::max(result.seconds, 1e-9);
+    return result;
+}
+
+// Runs RunBenchmark in a child process, when possible, so that its peak RSS is its own
+BenchmarkResult RunBenchmarkIsolated(const std::string& kind, int size, const std::string& mode) {
+#ifdef __linux__
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == 0) {
+        std::cout.flush();
+        pid_t child = fork();
+        if (child == 0) {
+            close(pipe_fds[0]);
+            BenchmarkResult result = RunBenchmark(kind, size, mode);
+            double values[4] = { result.seconds, double(result.edits), double(result.peak_bytes), double(result.allocations) };
+            ssize_t written = write(pipe_fds[1], values, sizeof(values));
+            _exit(written == ssize_t(sizeof(values)) ? 0 : 1);
+        }
+        close(pipe_fds[1]);
+        if (child > 0) {
+            double values[4] = { 0, 0, 0, 0 };
+            ssize_t got = read(pipe_fds[0], values, sizeof(values));
+            int status = 0;
+            struct rusage usage;
+            wait4(child, &status, 0, &usage);
+            close(pipe_fds[0]);
+            if (got == ssize_t(sizeof(values)) && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                std::vector<int> a, b;
+                GenerateBenchmarkInput(kind, size, mode, a, b);
+                BenchmarkResult result = { kind, mode, size, values[0], double(a.size() + b.size()) / std::max(values[0], 1e-9), usage.ru_maxrss,
+                                           (long long)values[1], (long long)values[2], (long long)values[3] };
+                return result;
+            }
+        }
+        else {
+            close(pipe_fds[0]);
+        }
+    }
+#endif
+    return RunBenchmark(kind, size, mode);
+}
+
+// Finds '"key": value' in one line of a baseline file
+std::string BaselineField(const std::string& line, const std::string& key) {
+    size_t at = line.find("\"" + key + "\":");
+    if (at == std::string::npos) {
+        return std::string();
+    }
+    size_t start = line.find_first_not_of(" \"", at + key.size() + 3);
+    size_t end = line.find_first_of(",\"}", start);
+    return start == std::string::npos ? std::string() : line.substr(start, end - start);
+}
+
+/*
+Runs every corpus kind at every scale with every engine mode and compares the throughput with a baseline:
+
+    myers-diff --bench BASELINE.json [--threshold PERCENT] [--scales 1,4,16] [--update]
+
+The baseline is a JSON array with one object per run. If it does not exist yet, or with '--update', it is
+(re)written with this run's results. Otherwise the exit status is 1 if any run is more than PERCENT (default
+10) percent slower than its baseline.
+*/
+int RunBenchmarks(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " --bench BASELINE.json [--threshold PERCENT] [--scales 1,4,16] [--update]\n";
+        return 2;
+    }
+    std::string baseline_path = argv[2];
+    double threshold = 10;
+    bool update = false;
+    std::vector<int> scales = { 1, 4 };
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threshold" && i + 1 < argc) {
+            threshold = std::atof(argv[++i]);
+        }
+        else if (arg == "--scales" && i + 1 < argc) {
+            scales.clear();
+            std::stringstream list(argv[++i]);
+            for (std::string scale; std::getline(list, scale, ',');) {
+                scales.push_back(std::atoi(scale.c_str()));
+            }
+        }
+        else if (arg == "--update") {
+            update = true;
+        }
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    std::ifstream baseline_file(baseline_path);
+    for (std::string line; std::getline(baseline_file, line);) {
+        std::string kind = BaselineField(line, "kind");
+        if (!kind.empty()) {
+            baseline[kind + "/" + BaselineField(line, "size") + "/" + BaselineField(line, "mode")] = std::atof(BaselineField(line, "throughput").c_str());
+        }
+    }
+    update = update || baseline.empty();
+
+    const char* kinds[] = { "source", "logs", "csv", "minjs", "binary" };
+    const char* modes[] = { "default", "scalar", "plain", "runs", "confusing", "lazy", "parallel", "unordered", "anchored", "block", "sorted" };
+    std::vector<BenchmarkResult> results;
+    int regressions = 0;
+    for (const char* kind : kinds) {
+        for (int scale : scales) {
+            for (const char* mode : modes) {
+                BenchmarkResult result = RunBenchmarkIsolated(kind, 10000 * scale, mode);
+                std::string key = result.kind + "/" + std::to_string(result.size) + "/" + result.mode;
+                std::map<std::string, double>::const_iterator base = baseline.find(key);
+                // A burst of other load can span a whole case, so a slow case is measured twice more before it counts
+                for (int retry = 0; retry < 2 && !update && base != baseline.end() && result.throughput < base->second * (1 - threshold / 100); retry++) {
+                    BenchmarkResult again = RunBenchmarkIsolated(kind, 10000 * scale, mode);
+                    if (again.throughput > result.throughput) {
+                        result = again;
+                    }
+                }
+                results.push_back(result);
+                std::cout << key << ": " << result.throughput / 1e6 << " M elements/s, " << result.peak_rss_kb << " KB peak RSS, "
+                          << result.peak_bytes << " bytes peak in the library, " << result.allocations << " allocations";
+                if (!update && base != baseline.end() && result.throughput < base->second * (1 - threshold / 100)) {
+                    std::cout << "  REGRESSION (baseline " << base->second / 1e6 << ")";
+                    regressions++;
+                }
+                std::cout << "\n";
+            }
+        }
+    }
+
+    if (update) {
+        std::ofstream out(baseline_path);
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& r = results[i];
+            out << "  {\"kind\": \"" << r.kind << "\", \"size\": " << r.size << ", \"mode\": \"" << r.mode << "\", \"seconds\": " << r.seconds
+                << ", \"throughput\": " << r.throughput << ", \"peak_rss_kb\": " << r.peak_rss_kb << ", \"edits\": " << r.edits
+                << ", \"peak_bytes\": " << r.peak_bytes << ", \"allocations\": " << r.allocations << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+        if (!out) {
+            std::cerr << "cannot write " << baseline_path << "\n";
+            return 2;
+        }
+    }
+    return regressions ? 1 : 0;
+}
+
+// The length of the longest common subsequence by the textbook dynamic program, as an oracle for the engines
+int LcsLength(const std::vector<int>& a, const std::vector<int>& b) {
+    std::vector<int> row(b.size() + 1, 0);
+    for (size_t i = 0; i < a.size(); i++) {
+        int diagonal = 0;
+        for (size_t j = 0; j < b.size(); j++) {
+            int above = row[j + 1];
+            row[j + 1] = a[i] == b[j] ? diagonal + 1 : std::max(row[j], above);
+            diagonal = above;
+        }
+    }
+    return row[b.size()];
+}
+
+// Whether 'diff' turns a into b, keeping only equal elements, with exactly 'edits' edits (or any number if it is -1)
+bool IsEditScript(const std::vector<int>& a, const std::vector<int>& b, const Diff& diff, long long edits = -1) {
+    int x = 0, y = 0;
+    long long seen = 0;
+    bool valid = true;
+    ForEachEditRun(diff, int(a.size()), int(b.size()), [&](const EditRun& run) {
+        valid = valid && run.old_pos == x && run.new_pos == y;
+        if (run.op == ' ') {
+            for (int i = 0; valid && i < run.length; i++) {
+                valid = a[x + i] == b[y + i];
+            }
+            x += run.length;
+            y += run.length;
+        }
+        else {
+            (run.op == '-' ? x : y) += run.length;
+            seen += run.length;
+        }
+    });
+    return valid && x == int(a.size()) && y == int(b.size()) && (edits < 0 || seen == edits) && (long long)diff.size() == seen;
+}
+
+// A random mask pattern over 'a', 'b', '1' and ' ', for checking MaskPattern against std::regex
+std::string RandomPattern(std::mt19937& rng, int depth) {
+    static const char* const atoms[] = { "a", "b", "1", " ", ".", "[ab]", "[^a]", "[a-b1]", "\\d", "\\w", "\\s", "\\W", "\\b", "\\B", "^", "$" };
+    static const char* const quantifiers[] = { "*", "+", "?", "{2}", "{1,3}", "{0,}", "*?", "+?", "??", "{1,2}?" };
+    switch (depth > 2 ? 0 : rng() % 5) {
+    case 0:
+    case 1:
+        return atoms[rng() % (sizeof(atoms) / sizeof(atoms[0]))];
+    case 2:
+        return RandomPattern(rng, depth + 1) + RandomPattern(rng, depth + 1);
+    case 3:
+        return "(" + RandomPattern(rng, depth + 1) + "|" + RandomPattern(rng, depth + 1) + ")";
+    default:
+        return "(?:" + RandomPattern(rng, depth + 1) + ")" + quantifiers[rng() % (sizeof(quantifiers) / sizeof(quantifiers[0]))];
+    }
+}
+
+/*
+What MaskPattern::Replace gives, worked out with std::regex_search. std::regex_replace itself retries after an
+empty match as if the line started there, so that ^ and \b would not see the character before.
+*/
+std::string RegexReplace(const std::string& line, const std::regex& pattern, const std::string& replacement) {
+    std::string replaced;
+    size_t pos = 0;
+    bool after_empty = false;
+    for (size_t start = 0; start <= line.size();) {
+        std::regex_constants::match_flag_type flags = start > 0 ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+        if (after_empty) {
+            flags |= std::regex_constants::match_not_null | std::regex_constants::match_continuous;
+        }
+        std::smatch match;
+        if (!std::regex_search(line.begin() + start, line.end(), match, pattern, flags)) {
+            if (!after_empty) {
+                break;
+            }
+            after_empty = false;
+            start++;
+            continue;
+        }
+        size_t first = start + match.position(0), end = first + match.length(0);
+        replaced.append(line, pos, first - pos);
+        replaced += replacement;
+        after_empty = end == first;
+        pos = start = end;
+    }
+    if (pos < line.size()) {
+        replaced.append(line, pos, std::string::npos);
+    }
+    return replaced;
+}
+
+/*
+./myers-diff --check [ROUNDS] [SEED]
+
+Diffs random pairs with every exact engine and checks each script against an LCS oracle: DiffSequences with
+and without the pre-pass and match runs, LazyEditScript, and ParallelEditScript, including a run whose sink
+fails partway, which must rethrow only after its tasks have drained. SortedMerge must give a minimal script
+on strictly increasing pairs, and UnorderedDiff the one counts of each value give. The engines that are valid
+but not minimal must give valid scripts: DiffSequences under a memory limit that forces it to diff in slices,
+BlockMatchDiff, and AnchoredDiff, which must also match every anchor or reject anchors out of order. A
+DiffCheckpoint must survive a write and read, resume to a valid script, and be refused for other masks or
+changed lines. It also checks the SIMD snake kernel this CPU uses against the scalar one, and MaskPattern
+against std::regex on random patterns and lines. Built with -fsanitize=thread (or address), this is also the
+race check for the parallel engines. Exits with status 1 on the first mismatch.
+*/
+int RunSelfCheck(int argc, char* argv[]) {
+    int rounds = argc >= 3 ? std::atoi(argv[2]) : 200;
+    unsigned seed = argc >= 4 ? unsigned(std::strtoul(argv[3], nullptr, 10)) : 1;
+    std::mt19937 rng(seed);
+    ThreadPool pool(4);
+    for (int round = 0; round < rounds; round++) {
+        // Small alphabets give many competing paths, mostly-equal pairs give long snakes and runs
+        int alphabet = 1 + int(rng() % 20);
+        std::vector<int> a(rng() % 400), b;
+        for (int& v : a) {
+            v = int(rng() % alphabet);
+        }
+        if (rng() % 2) {
+            b = a;
+            for (int edits = int(rng() % 20); edits > 0 && !b.empty(); edits--) {
+                size_t i = rng() % b.size();
+                if (rng() % 2) {
+                    b.erase(b.begin() + i);
+                }
+                else {
+                    b.insert(b.begin() + i, int(rng() % (alphabet + 5)));
+                }
+            }
+        }
+        else {
+            b.resize(rng() % 400);
+            for (int& v : b) {
+                v = int(rng() % alphabet);
+            }
+        }
+        int N = int(a.size()), M = int(b.size());
+        long long edits = N + M - 2LL * LcsLength(a, b);
+        std::vector<std::pair<std::string, Diff>> scripts;
+
+        Options options;
+        scripts.push_back(std::make_pair("default", DiffSequences(a.data(), N, b.data(), M, options)));
+        options.discard_unique = false;
+        options.match_runs = 0;
+        scripts.push_back(std::make_pair("plain", DiffSequences(a.data(), N, b.data(), M, options)));
+        options.match_runs = 1;
+        scripts.push_back(std::make_pair("runs", DiffSequences(a.data(), N, b.data(), M, options)));
+
+        Diff lazy;
+        LazyEditScript script(a.data(), N, b.data(), M);
+        for (const LazyEditScript::Hunk& hunk : script) {
+            for (int i = 0; i < hunk.old_length; i++) {
+                lazy.insert(std::make_pair(hunk.old_start + i, std::string("del")));
+            }
+            for (int i = 0; i < hunk.new_length; i++) {
+                lazy.insert(std::make_pair(hunk.new_start + i, std::string("add")));
+            }
+        }
+        scripts.push_back(std::make_pair("lazy", lazy));
+
+        Diff parallel;
+        ParallelEditScript(pool, a.data(), N, b.data(), M, [&parallel](const Diff& piece) { parallel.insert(piece.begin(), piece.end()); }, 4);
+        scripts.push_back(std::make_pair("parallel", parallel));
+
+        for (const std::pair<std::string, Diff>& checked : scripts) {
+            if (!IsEditScript(a, b, checked.second, edits)) {
+                std::cerr << "round " << round << " (seed " << seed << "): " << checked.first << " gives " << checked.second.size()
+                          << " edits, expected " << edits << "\n";
+                return 1;
+            }
+        }
+
+        // A limit of half the estimate makes DiffSequences diff the pair in slices, which must still fit together
+        Options limited;
+        limited.memory_limit = EstimateDiffMemory(N, M, limited) / 2;
+        try {
+            Diff chunked = DiffSequences(a.data(), N, b.data(), M, limited);
+            if (!IsEditScript(a, b, chunked)) {
+                std::cerr << "round " << round << " (seed " << seed << "): the script diffed in slices under a memory limit is not valid\n";
+                return 1;
+            }
+        }
+        catch (const MemoryLimitExceeded& e) {
+            std::cerr << "round " << round << " (seed " << seed << "): " << e.what() << "\n";
+            return 1;
+        }
+
+        // SortedMerge on strictly increasing sequences, which mostly share their elements or mostly do not
+        std::vector<int> sorted[2];
+        unsigned shared = rng() % 100;
+        for (int v = 0, count = int(rng() % 400); v < count; v++) {
+            bool both = rng() % 100 < shared;
+            unsigned side = rng() % 2;
+            for (unsigned s = 0; s < 2; s++) {
+                if (both || s == side) {
+                    sorted[s].push_back(v);
+                }
+            }
+        }
+        Diff merged = SortedMerge(sorted[0].data(), int(sorted[0].size()), sorted[1].data(), int(sorted[1].size()));
+        long long merged_edits = (long long)sorted[0].size() + sorted[1].size() - 2LL * LcsLength(sorted[0], sorted[1]);
+        if (!IsEditScript(sorted[0], sorted[1], merged, merged_edits)) {
+            std::cerr << "round " << round << " (seed " << seed << "): SortedMerge gives " << merged.size() << " edits, expected "
+                      << merged_edits << "\n";
+            return 1;
+        }
+
+        // UnorderedDiff against multiset counts: the occurrences of a value past its count on the other side are edits
+        Diff unordered = UnorderedDiff(pool, a.data(), N, b.data(), M, 1 + int(rng() % 4)), counted;
+        for (int side = 0; side < 2; side++) {
+            const std::vector<int>& sequence = side ? b : a;
+            const std::vector<int>& other = side ? a : b;
+            std::map<int, int> seen;
+            for (int i = 0; i < int(sequence.size()); i++) {
+                if (++seen[sequence[i]] > std::count(other.begin(), other.end(), sequence[i])) {
+                    counted.insert(std::make_pair(i, std::string(side ? "add" : "del")));
+                }
+            }
+        }
+        if (unordered != counted) {
+            std::cerr << "round " << round << " (seed " << seed << "): UnorderedDiff gives " << unordered.size() << " edits, the counts "
+                      << counted.size() << "\n";
+            return 1;
+        }
+
+        // AnchoredDiff on the pair with the same markers spliced into both at random places, every marker an anchor;
+        // swapping two markers on one side must be reported instead
+        int markers = int(rng() % 8);
+        auto with_markers = [&](const std::vector<int>& sequence) {
+            std::vector<int> spliced(sequence);
+            std::vector<size_t> at;
+            for (int i = 0; i < markers; i++) {
+                at.push_back(rng() % (sequence.size() + 1));
+            }
+            std::sort(at.begin(), at.end());
+            for (int i = markers - 1; i >= 0; i--) {
+                spliced.insert(spliced.begin() + at[i], 1000 + i);
+            }
+            return spliced;
+        };
+        std::vector<int> anchored_old = with_markers(a), anchored_new = with_markers(b);
+        bool crossed = markers >= 2 && rng() % 4 == 0;
+        if (crossed) {
+            std::iter_swap(std::find(anchored_new.begin(), anchored_new.end(), 1000), std::find(anchored_new.begin(), anchored_new.end(), 1001));
+        }
+        try {
+            Diff anchored = AnchoredDiff(pool, anchored_old.data(), int(anchored_old.size()), anchored_new.data(), int(anchored_new.size()),
+                                         [](int v) { return v >= 1000; });
+            bool aligned = !crossed && IsEditScript(anchored_old, anchored_new, anchored);
+            for (Diff::const_iterator it = anchored.begin(); aligned && it != anchored.end(); it++) {
+                aligned = (it->second == "del" ? anchored_old : anchored_new)[it->first] < 1000;
+            }
+            if (!aligned) {
+                std::cerr << "round " << round << " (seed " << seed << "): AnchoredDiff gives "
+                          << (crossed ? "a script for anchors out of order" : "an invalid script or leaves an anchor unmatched") << "\n";
+                return 1;
+            }
+        }
+        catch (const std::invalid_argument& e) {
+            if (!crossed) {
+                std::cerr << "round " << round << " (seed " << seed << "): AnchoredDiff rejects anchors in order: " << e.what() << "\n";
+                return 1;
+            }
+        }
+
+        // A checkpoint of random prefixes of the pair, written out and read back, must resume to a valid script, and
+        // must not apply to other masks, to a changed prefix or to files that shrank
+        LineInterner interner;
+        std::vector<int> ids[2];
+        for (int side = 0; side < 2; side++) {
+            for (int v : side ? b : a) {
+                ids[side].push_back(interner.Intern("line " + std::to_string(v)));
+            }
+        }
+        DiffCheckpoint taken;
+        taken.old_length = int(rng() % (N + 1));
+        taken.new_length = int(rng() % (M + 1));
+        taken.old_hash = HashLines(0, ids[0], 0, taken.old_length, interner);
+        taken.new_hash = HashLines(0, ids[1], 0, taken.new_length, interner);
+        taken.edits = DiffSequences(a.data(), taken.old_length, b.data(), taken.new_length);
+        std::stringstream file;
+        DiffCheckpoint checkpoint;
+        uint64_t old_hash = 0, new_hash = 0;
+        if (!taken.Write(file) || !checkpoint.Read(file) || checkpoint.edits != taken.edits ||
+            !CheckpointApplies(checkpoint, ids[0], ids[1], interner, 0, old_hash, new_hash) ||
+            !IsEditScript(a, b, ResumeDiff(checkpoint, a.data(), N, b.data(), M))) {
+            std::cerr << "round " << round << " (seed " << seed << "): a checkpoint does not resume to a valid script\n";
+            return 1;
+        }
+        std::vector<int> changed_ids(ids[0]);
+        if (taken.old_length > 0) {
+            changed_ids[rng() % taken.old_length] = interner.Intern("changed");
+        }
+        checkpoint.old_length = N + 1;
+        if (CheckpointApplies(taken, ids[0], ids[1], interner, 1, old_hash, new_hash) ||
+            (taken.old_length > 0 && CheckpointApplies(taken, changed_ids, ids[1], interner, 0, old_hash, new_hash)) ||
+            CheckpointApplies(checkpoint, ids[0], ids[1], interner, 0, old_hash, new_hash)) {
+            std::cerr << "round " << round << " (seed " << seed << "): a checkpoint applies to lines it was not taken from\n";
+            return 1;
+        }
+
+        // BlockMatchDiff on the pair as bytes, with small blocks so that it finds matches, and sometimes so small a
+        // gap limit that gaps are replaced outright
+        std::vector<unsigned char> bytes[2] = { std::vector<unsigned char>(a.begin(), a.end()), std::vector<unsigned char>(b.begin(), b.end()) };
+        Diff blocks = BlockMatchDiff(pool, bytes[0].data(), N, bytes[1].data(), M, 2 + int(rng() % 8), Options(), rng() % 2 ? 1 << 13 : 8);
+        if (!IsEditScript(a, b, blocks)) {
+            std::cerr << "round " << round << " (seed " << seed << "): BlockMatchDiff gives an invalid script\n";
+            return 1;
+        }
+
+        // The sink fails on its second piece; the sequences go out of scope as soon as the call returns
+        std::unique_ptr<std::vector<int>> old_copy(new std::vector<int>(a)), new_copy(new std::vector<int>(b));
+        int pieces = 0;
+        bool thrown = false;
+        try {
+            ParallelEditScript(pool, old_copy->data(), N, new_copy->data(), M, [&pieces](const Diff&) {
+                if (++pieces == 2) {
+                    throw std::runtime_error("sink failed");
+                }
+            }, 4);
+        }
+        catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        old_copy.reset();
+        new_copy.reset();
+        if (thrown != (pieces >= 2)) {
+            std::cerr << "round " << round << " (seed " << seed << "): a failing sink was " << (thrown ? "" : "not ") << "reported\n";
+            return 1;
+        }
+
+        // The snake kernels against the scalar one, on a pair that agrees up to a random point from either end
+        std::vector<int> changed(a);
+        if (!changed.empty()) {
+            changed[rng() % N] ^= 1;
+        }
+        const SnakeKernel& best = BestSnakeKernel();
+        int length = int(rng() % (N + 1));
+        if (best.forward(a.data(), changed.data(), length) != ScalarMatchForward(a.data(), changed.data(), length) ||
+            best.backward(a.data() + N, changed.data() + N, length) != ScalarMatchBackward(a.data() + N, changed.data() + N, length)) {
+            std::cerr << "round " << round << " (seed " << seed << "): the " << best.name << " snake kernel disagrees with the scalar one\n";
+            return 1;
+        }
+
+        for (int tries = 0; tries < 4; tries++) {
+            std::string source = RandomPattern(rng, 0);
+            std::unique_ptr<MaskPattern> pattern;
+            try {
+                pattern.reset(new MaskPattern(source));
+            }
+            catch (const std::invalid_argument&) {
+                // An unbounded repeat of something that can match nothing
+                continue;
+            }
+            std::regex expected(source, std::regex::ECMAScript);
+            for (int lines = 0; lines < 20; lines++) {
+                std::string line(rng() % 12, ' ');
+                for (char& c : line) {
+                    c = "ab1 "[rng() % 4];
+                }
+                if (pattern->Replace(line, "#") != RegexReplace(line, expected, "#")) {
+                    std::cerr << "round " << round << " (seed " << seed << "): /" << source << "/ replaces '" << line << "' as '"
+                              << pattern->Replace(line, "#") << "', std::regex as '" << RegexReplace(line, expected, "#") << "'\n";
+                    return 1;
+                }
+            }
+        }
+    }
+    std::cout << rounds << " rounds passed\n";
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && std::string(argv[1]) == "--bench") {
+        return RunBenchmarks(argc, argv);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--check") {
+        return RunSelfCheck(argc, argv);
+    }
+#ifdef MYERS_WITH_ZLIB
+    if (argc >= 2 && std::string(argv[1]) == "--git") {
+        return RunGitCommandLine(argc, argv);
+    }
+#endif
+    if (argc >= 3) {
+        return RunCommandLine(argc, argv);
+    }
+
     int a[] = { 1,4,27,21,23,24,26,28,13 }; //old
     int b[] = { 1,4,20,21,22,23,24,25,26,13 }; //new
 
 
     Diff result = ShortestEditScript(a, sizeof(a) / sizeof(int), b, sizeof(b) / sizeof(int), 0, 0);
+    WriteEditScript(std::cout, a, sizeof(a) / sizeof(int), b, sizeof(b) / sizeof(int), result);
     for (Diff::iterator it = result.begin(); it != result.end(); it++)
     {
         std::cout << it->first << it->second << "\n";